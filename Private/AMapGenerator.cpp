@@ -26,75 +26,521 @@
 #include <cstdlib>
 #include "Public/PerlinNoiseGeneration.h"
 #include "Engine/StaticMesh.h"
+#include "Async/ParallelFor.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "Async/Async.h"
+#include "HAL/ThreadSafeCounter.h"
 #include <cmath>
 #include "public/Prop.h"
+#include "public/RockMesh.h"
+#include "public/TreeMesh.h"
+#include "Public/CounterRandom.h"
+#include "Public/MeshAdjacency.h"
+#include "Kismet/GameplayStatics.h"
 
 // Sets default values
 AAMapGenerator::AAMapGenerator()
 {
  	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
 	PrimaryActorTick.bCanEverTick = true;
+
+	//Tick only drives the time sliced generation and the chunk streaming, it is turned on when one of them needs it
+	PrimaryActorTick.bStartWithTickEnabled = false;
 }
 
-void AAMapGenerator::GenerateMapData()
+bool AAMapGenerator::GenerateMapData()
 {
-	//init Bioms
-	InitBioms();
+	//the buffers are in use until the running generation is done
+	if (!AAMapGenerator::CanStartGeneration(TEXT("GenerateMapData")))
+		return false;
+
+	if (AAMapGenerator::BeginMapGeneration())
+		return true;
+
+	AAMapGenerator::FinishMapGeneration(AAMapGenerator::GenerateLandData());
+	return true;
+}
+
+
+bool AAMapGenerator::GenerateMapDataAsync()
+{
+	//only one map is generated at a time
+	if (!AAMapGenerator::CanStartGeneration(TEXT("GenerateMapDataAsync")))
+		return false;
+
+	if (AAMapGenerator::BeginMapGeneration())
+		return true;
+
+	//the task only works on the generation state and on the parameters copied by BeginMapGeneration, never on the
+	//properties or the bioms. EndPlay waits for it so the generator outlives it,
+	//but the generator may be gone by the time the game thread gets to spawn the actors
+	asyncGenerationRunning = true;
+	TWeakObjectPtr<AAMapGenerator> weakThis = this;
+	generationTask = Async(EAsyncExecution::ThreadPool, [this, weakThis]()
+	{
+		bool generated = AAMapGenerator::GenerateLandData();
+
+		AsyncTask(ENamedThreads::GameThread, [weakThis, generated]()
+		{
+			if (weakThis.IsValid())
+				weakThis->FinishMapGeneration(generated);
+		});
+	});
+	return true;
+}
+
 
-		//Generate Noise Map
-		if (GEngine)
-			GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Yellow, TEXT("Generating Noise Map"));
-		
-		if (GenerateNoise()) {
+bool AAMapGenerator::GenerateMapDataTimeSliced()
+{
+	//the buffers are in use until the running generation is done
+	if (!AAMapGenerator::CanStartGeneration(TEXT("GenerateMapDataTimeSliced")))
+		return false;
+
+	if (AAMapGenerator::BeginMapGeneration())
+		return true;
+
+	//the noise stage is set up here, every other stage is set up by the one before it
+	generationState.Reset(params.mapSize, params.storeNoiseGradient);
+	slicedGeneration.noiseGenerator = MakeUnique<PerlinNoiseGeneration>(params.seed, params.mapSize, params.octaves, params.persistance, params.baseFrequency, params.legacyNoise && !params.streamChunks);
+	slicedGeneration.minNoise = 100;
+	slicedGeneration.maxNoise = -1;
+	slicedGeneration.stage = EGenerationStage::Noise;
+	slicedGeneration.step = 0;
+	slicedGeneration.running = true;
+
+	//the generation is driven from Tick
+	SetActorTickEnabled(true);
+	return true;
+}
+
+
+bool AAMapGenerator::IsGenerating() const
+{
+	return asyncGenerationRunning || slicedGeneration.running;
+}
+
+
+// A request made while a map is generated is rejected, as it would need the buffers of the running generation.
+// It is logged so that a caller waiting for LandDoneDelegate can tell why it never comes
+bool AAMapGenerator::CanStartGeneration(const TCHAR* request)
+{
+	if (!AAMapGenerator::IsGenerating())
+		return true;
 
-			//Generate Landmarks
-			if (GEngine)
-				GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Yellow, TEXT("Picking landmarks"));
+	UE_LOG(LogTemp, Warning, TEXT("%s ignored on %s: a map is already being generated"), request, *GetName());
+	return false;
+}
+
+
+// Runs the next unit of work of the time sliced generation. Returns true once the map is done
+bool AAMapGenerator::StepSlicedGeneration()
+{
+	FSlicedGeneration& sliced = slicedGeneration;
+	int bandCount = FMath::Max(1, FMath::DivideAndRoundUp(params.mapSize, noiseBandHeight));
+	int firstRow = (sliced.step % bandCount) * noiseBandHeight;
+	int lastRow = FMath::Min(firstRow + noiseBandHeight, params.mapSize);
+
+	switch (sliced.stage)
+	{
+	case EGenerationStage::Noise:
+		//each band is generated during the first pass, then normalized during the second one
+		if (sliced.step < bandCount)
+		{
+			float minNoise, maxNoise;
+			AAMapGenerator::GenerateNoiseRows(*sliced.noiseGenerator, firstRow, lastRow, minNoise, maxNoise);
+			sliced.minNoise = FMath::Min(sliced.minNoise, minNoise);
+			sliced.maxNoise = FMath::Max(sliced.maxNoise, maxNoise);
+		}
+		else
+		{
+			if (sliced.step == bandCount && params.streamChunks)
+			{
+				sliced.minNoise = params.chunkNoiseRange.X;
+				sliced.maxNoise = params.chunkNoiseRange.Y;
+			}
+			AAMapGenerator::NormalizeNoiseRows(firstRow, lastRow, sliced.minNoise, sliced.maxNoise);
+		}
+
+		if (++sliced.step == 2 * bandCount)
+		{
+			sliced.noiseGenerator.Reset();
+			AAMapGenerator::AdvanceSlicedStage(EGenerationStage::Landmarks);
+		}
+		return false;
+
+	case EGenerationStage::Landmarks:
+		//the landmarks are picked in one go, then each of them is flattened in a step and the flattening spreads a ring per step
+		if (sliced.step == 0)
+		{
 			PickLandmarks();
+			AAMapGenerator::BeginLandmarkFlattening();
+		}
+		else if (sliced.step <= generationState.landmarkPlacements.Num())
+		{
+			AAMapGenerator::FlattenLandmark(generationState.landmarkPlacements[sliced.step - 1]);
+		}
+		else if (!AAMapGenerator::SpreadLandmarkFlattening())
+		{
+			AAMapGenerator::UpdateReshapedGradient();
+			AAMapGenerator::AdvanceSlicedStage(EGenerationStage::Terrace);
+			return false;
+		}
+		sliced.step++;
+		return false;
+
+	case EGenerationStage::Terrace:
+		AAMapGenerator::TerraceNoiseRows(firstRow, lastRow);
+		if (++sliced.step == bandCount)
+		{
+			generationState.ResetLevelMasks(params.mapLevels);
+			AAMapGenerator::AdvanceSlicedStage(EGenerationStage::Cluster);
+		}
+		return false;
+
+	case EGenerationStage::Cluster:
+		//a mask per step
+		if (sliced.step < params.mapLevels)
+		{
+			AAMapGenerator::FillLevelMask(sliced.step++);
+			return false;
+		}
+
+		generationState.BeginLabelIslands();
+		AAMapGenerator::AdvanceSlicedStage(EGenerationStage::Islands);
+		return false;
+
+	case EGenerationStage::Islands:
+		//the islands of a level per step, from the lowest one up as islands are parented to the level below
+		if (sliced.step < generationState.levelMasks.Num())
+		{
+			generationState.LabelLevelIslands(sliced.step++, noiseBandHeight, true);
+			return false;
+		}
+
+		sliced.landJobs = AAMapGenerator::GetLandJobs();
+		generationState.builtLands.Reset();
+		generationState.ResetVertexGrids(1);
+		AAMapGenerator::AdvanceSlicedStage(EGenerationStage::Mesh);
+		return false;
 
-			//Have Landmarks impact noise
-			if (GEngine)
-				GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Yellow, TEXT("Matching noise to landmarks"));
-			MatchLandToLandmarks();
+	case EGenerationStage::Mesh:
+		//a phase of the build of a land per step
+		if (!sliced.landBuild.IsValid() && sliced.step < sliced.landJobs.Num())
+		{
+			sliced.landBuild = MakeUnique<FLandBuild>();
+			sliced.landBuild->depth = sliced.landJobs[sliced.step].X;
+			sliced.landBuild->island = sliced.landJobs[sliced.step].Y;
+			sliced.step++;
+		}
+
+		if (sliced.landBuild.IsValid())
+		{
+			if (AAMapGenerator::StepLandBuild(*sliced.landBuild, generationState.vertexGrids[0]))
+			{
+				generationState.builtLands.Append(MoveTemp(sliced.landBuild->blocks));
+				sliced.landBuild.Reset();
+			}
+			return false;
+		}
 
-			//Terrace Noise
-			if (GEngine)
-				GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Yellow, TEXT("Terracing noise"));
-			TerraceNoise();
+		if (params.mergeLandsByBiom)
+			AAMapGenerator::MergeLandsByBiom(generationState.builtLands);
+		AAMapGenerator::AdvanceSlicedStage(EGenerationStage::Cache);
+		return false;
 
-			//Cluster Noise
-			if (GEngine)
-				GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Yellow, TEXT("Clustering noise"));
-			ClusterNoise();
+	case EGenerationStage::Cache:
+		//the lands are copied for the cache in a step and the tile is stored in the next one
+		if (params.useTileCache && sliced.step == 0)
+		{
+			AAMapGenerator::PrepareBuiltTile();
+		}
+		else if (params.useTileCache && sliced.step == 1)
+		{
+			AAMapGenerator::StoreBuiltTile(FIntPoint(0, 0));
+		}
+		else
+		{
+			AAMapGenerator::AdvanceSlicedStage(EGenerationStage::Spawn);
+			return false;
+		}
+		sliced.step++;
+		return false;
 
-			//Generate Mesh
-			if (GEngine)
-				GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Yellow, TEXT("Generating Mesh"));
-			GenerateMesh();
+	default:
+		//the landmarks in a step, then a land is spawned per step, then the mesh component of a land (a block when the lands
+		//are split) is built and its collision cooked per step
+		if (sliced.step == 0)
+		{
+			SpawnLandmarks();
+		}
+		else if (sliced.step <= generationState.builtLands.Num())
+		{
+			meshes.Add(AAMapGenerator::SpawnLand(MoveTemp(generationState.builtLands[sliced.step - 1])));
 		}
+		else if (sliced.step <= generationState.builtLands.Num() + meshes.Num())
+		{
+			AAMapGenerator::UploadLand(meshes[sliced.step - generationState.builtLands.Num() - 1]);
+		}
+		else
+		{
+			generationState.builtLands.Reset();
+			sliced.running = false;
+			AAMapGenerator::FinishMapGeneration(false);
+
+			//chunk streaming keeps ticking
+			if (!params.streamChunks)
+				SetActorTickEnabled(false);
+			return true;
+		}
+		sliced.step++;
+		return false;
+	}
+}
+
+
+// Reports the end of the current stage of the time sliced generation and starts the next one
+void AAMapGenerator::AdvanceSlicedStage(EGenerationStage nextStage)
+{
+	AAMapGenerator::ReportStage(slicedGeneration.stage);
+	slicedGeneration.stage = nextStage;
+	slicedGeneration.step = 0;
+}
+
+
+// Game thread part of the start of a generation: clears the previous map and restores the new one from the cache
+// when possible. Returns true if the map was restored, in which case the generation is already done
+bool AAMapGenerator::BeginMapGeneration()
+{
+	//init Bioms
+	InitBioms();
+
+	//give the actors of the previous map back to the generation state
+	ClearMap();
+
+	//if we want a random seed, randomize the seed
+	if (randomSeed)
+		seed = rand();
+
+	//from here on the generation only reads its own copy of the parameters
+	AAMapGenerator::SnapshotParameters();
+
+	//the single map is centered on 0,0
+	noiseOffset = FIntPoint(0, 0);
+	meshOffset = FVector2D(-((float)params.mapSize - 1.0f) / 2.0f, -((float)params.mapSize - 1.0f) / 2.0f);
+
+	//a map which was already generated with the same parameters is simply restored
+	if (params.useTileCache && RestoreTileFromCache(FIntPoint(0, 0), meshes))
+	{
+		//landmarks are actors so they still have to be spawned. They land at the same spots as the picks only depend on the seed
+		PickLandmarks();
+		SpawnLandmarks();
+		AAMapGenerator::UploadLands(meshes);
+		AAMapGenerator::ReportStage(EGenerationStage::Spawn);
+		LandDoneDelegate.Broadcast();
+		return true;
+	}
+
+	return false;
+}
+
+
+// Copies the properties the generation depends on, so that a map is generated with the same parameters from start
+// to end even if they are changed meanwhile. The bioms are spawned beforehand as their separations are copied too
+void AAMapGenerator::SnapshotParameters()
+{
+	params.mapSize = mapSize;
+	params.seed = seed;
+	//levelMap stores the levels on a byte, the metadata clamp is not applied to values set from code or blueprints
+	params.mapLevels = FMath::Clamp(mapLevels, 2, 255);
+	params.globalScale = globalScale;
+	params.heightScale = heightScale;
+	params.AddRiver = AddRiver;
+	params.riverWidthFactor = riverWidthFactor;
+	params.multithreadedGeneration = multithreadedGeneration;
+	params.weldTolerance = weldTolerance;
+	params.greedyTopMesh = greedyTopMesh;
+	params.visibleSurfaceOnly = visibleSurfaceOnly;
+	params.meshPerIsland = meshPerIsland;
+	params.landBlockSize = landBlockSize;
+	params.lodCount = lodCount;
+	params.mergeLandsByBiom = mergeLandsByBiom;
+	params.octaves = octaves;
+	params.persistance = persistance;
+	params.baseFrequency = baseFrequency;
+	params.noiseExponent = noiseExponent;
+	params.legacyNoise = legacyNoise;
+	params.vectorizedNoise = vectorizedNoise;
+	params.storeNoiseGradient = storeNoiseGradient;
+	params.streamChunks = streamChunks;
+	params.chunkNoiseRange = chunkNoiseRange;
+	//a map with a new random seed each time is never generated twice, so storing it would only cost a copy. Streamed
+	//chunks keep the seed picked in BeginPlay and are generated again when the player walks back to them
+	params.useTileCache = useTileCache && (streamChunks || !randomSeed);
+	params.amountOfLandmarks = amountOfLandmarks;
+	params.potentialLandmarks = potentialLandmarks;
+
+	params.biomSeparations.Reset();
+	for (ABiom* biom : inGameBioms)
+		params.biomSeparations.Add(biom->biomSeparation);
+}
+
+
+// Runs the stages of the generation which do not touch any actor, so it can run on any thread.
+// The landmarks and lands are left in the generation state for FinishMapGeneration
+bool AAMapGenerator::GenerateLandData()
+{
+	if (!GenerateNoise())
+		return false;
+	AAMapGenerator::ReportStage(EGenerationStage::Noise);
+
+	//Pick landmarks and have them impact noise
+	PickLandmarks();
+	MatchLandToLandmarks();
+	AAMapGenerator::ReportStage(EGenerationStage::Landmarks);
+
+	TerraceNoise();
+	AAMapGenerator::ReportStage(EGenerationStage::Terrace);
+
+	ClusterNoise();
+	AAMapGenerator::ReportStage(EGenerationStage::Cluster);
+
+	generationState.LabelIslands(noiseBandHeight, !params.multithreadedGeneration);
+	AAMapGenerator::ReportStage(EGenerationStage::Islands);
+
+	BuildLands();
+	AAMapGenerator::ReportStage(EGenerationStage::Mesh);
+
+	//the copy for the cache is made here so that it stays off the game thread
+	if (params.useTileCache)
+		AAMapGenerator::PrepareBuiltTile();
+	AAMapGenerator::ReportStage(EGenerationStage::Cache);
+
+	return true;
+}
+
+
+// Game thread part of the end of a generation: spawns the landmarks and lands which were generated.
+// The time sliced generation spawns them itself, a land at a time, and only calls it to report the end
+void AAMapGenerator::FinishMapGeneration(bool generated)
+{
+	asyncGenerationRunning = false;
+
+	if (generated)
+	{
+		SpawnLandmarks();
+
+		for (FLandMeshData& land : generationState.builtLands)
+			meshes.Add(AAMapGenerator::SpawnLand(MoveTemp(land)));
+		generationState.builtLands.Reset();
+
+		AAMapGenerator::StoreBuiltTile(FIntPoint(0, 0));
+		AAMapGenerator::UploadLands(meshes);
+	}
+	builtTile.Reset();
+	AAMapGenerator::ReportStage(EGenerationStage::Spawn);
 
 	//When done call Done event
 	LandDoneDelegate.Broadcast();
 }
 
+
+// Builds the mesh components of the lands when requested. The lands are cached beforehand as their geometry may be released
+void AAMapGenerator::UploadLands(const TArray<ALand*>& lands)
+{
+	if (!createLandComponents)
+		return;
+
+	for (ALand* land : lands)
+		land->UploadMesh(landMaterial, releaseLandData);
+}
+
+
+void AAMapGenerator::UploadLand(ALand* land)
+{
+	if (createLandComponents)
+		land->UploadMesh(landMaterial, releaseLandData);
+}
+
+
+// Broadcasts the end of a stage on the game thread
+void AAMapGenerator::ReportStage(EGenerationStage stage)
+{
+	float progress = ((int)stage + 1) / (float)((int)EGenerationStage::Spawn + 1);
+
+	if (IsInGameThread())
+	{
+		GenerationProgressDelegate.Broadcast(stage, progress);
+		return;
+	}
+
+	TWeakObjectPtr<AAMapGenerator> weakThis = this;
+	AsyncTask(ENamedThreads::GameThread, [weakThis, stage, progress]()
+	{
+		if (weakThis.IsValid())
+			weakThis->GenerationProgressDelegate.Broadcast(stage, progress);
+	});
+}
+
 int AAMapGenerator::GetMeshCount()
 {
 	return meshes.Num();
 }
 
-// A utility function to retrieve the geometry and color from a land
-void AAMapGenerator::GetMeshData(int meshIdx, TArray<FVector>& verts, TArray<int>& tris, TArray<FVector2D>& uvs, FLinearColor& color)
+// Same as GetMeshData, with the normals and tangents built with the geometry
+void AAMapGenerator::GetMeshDataWithNormals(int meshIdx, TArray<FVector>& verts, TArray<int>& tris, TArray<FVector2D>& uvs,
+	TArray<FVector>& normals, TArray<FProcMeshTangent>& tangents, FLinearColor& color, int lod)
 {
-	verts = meshes[meshIdx]->verts;
-	tris = meshes[meshIdx]->tris;
-	uvs = meshes[meshIdx]->uvs;
+	meshes[meshIdx]->GetLODData(lod, verts, tris, uvs, normals, tangents);
 	color = meshes[meshIdx]->biom->biomColor;
 }
 
+int AAMapGenerator::GetMeshLODCount(int meshIdx)
+{
+	return meshes[meshIdx]->lods.Num() + 1;
+}
+
+// A utility function to retrieve the geometry and color from a land, at a level of detail (0 being the full resolution)
+void AAMapGenerator::GetMeshData(int meshIdx, TArray<FVector>& verts, TArray<int>& tris, TArray<FVector2D>& uvs, FLinearColor& color, int lod)
+{
+	meshes[meshIdx]->GetLODData(lod, verts, tris, uvs);
+	color = meshes[meshIdx]->biom->biomColor;
+}
+
+TArray<int> AAMapGenerator::GetMeshesInRadius(FVector center, float radius)
+{
+	TArray<int> indices = TArray<int>();
+	for (int i = 0; i < meshes.Num(); i++)
+	{
+		if (meshes[i]->bounds.IsValid && meshes[i]->bounds.ComputeSquaredDistanceToPoint(center) <= radius * radius)
+			indices.Add(i);
+	}
+
+	return indices;
+}
+
+int AAMapGenerator::GetChunkMeshCount(FIntPoint chunk)
+{
+	FTerrainChunk* terrainChunk = chunks.Find(chunk);
+	return terrainChunk ? terrainChunk->lands.Num() : 0;
+}
+
+// Same as GetMeshData for the lands of a streamed chunk. The chunk may have been evicted since its mesh count was read,
+// in which case the outputs are left untouched
+void AAMapGenerator::GetChunkMeshData(FIntPoint chunk, int meshIdx, TArray<FVector>& verts, TArray<int>& tris, TArray<FVector2D>& uvs, FLinearColor& color, int lod)
+{
+	FTerrainChunk* terrainChunk = chunks.Find(chunk);
+	if (!terrainChunk || !terrainChunk->lands.IsValidIndex(meshIdx) || !IsValid(terrainChunk->lands[meshIdx]))
+		return;
+
+	ALand* land = terrainChunk->lands[meshIdx];
+	land->GetLODData(lod, verts, tris, uvs);
+	color = land->biom->biomColor;
+}
+
 // Returns the height of the separation between water and sand + one half of a level
 float AAMapGenerator::GetWaterHeight()
 {
-	return (floor((mapLevels - 1) * waterLine) + 0.5) * heightScale * globalScale;
+	return (floor((params.mapLevels - 1) * waterLine) + 0.5) * params.heightScale * params.globalScale;
 }
 
 
@@ -102,7 +548,7 @@ float AAMapGenerator::GetWaterHeight()
 float AAMapGenerator::GetStartHeight()
 {
 	// TODO: make the 40 into a parameter
-	return (mapLevels + 40) * heightScale * globalScale;
+	return (params.mapLevels + 40) * params.heightScale * params.globalScale;
 }
 
 // Returns the position and type of the clouds
@@ -112,136 +558,319 @@ void AAMapGenerator::GetCloudData(TArray<UStaticMesh*>& clouds, TArray<FVector>&
 	position = cloudsPosition;
 }
 
+// Builds a key out of every parameter the land and noise map of a tile depend on
+FString AAMapGenerator::GetTileCacheKey(FIntPoint tile)
+{
+	FString key = FString::Printf(TEXT("%d_%d_%g_%g_%d_%d_%d_%d_%d_%g_%g_%d"), params.seed, params.octaves, params.persistance, params.baseFrequency,
+		params.noiseExponent, params.mapLevels, tile.X, tile.Y, params.mapSize, params.heightScale, params.globalScale, params.legacyNoise ? 1 : 0);
+
+	if (params.meshPerIsland)
+		key += TEXT("_islands");
+	if (params.landBlockSize > 0)
+		key += FString::Printf(TEXT("_blocks_%d"), params.landBlockSize);
+	if (params.lodCount > 1)
+		key += FString::Printf(TEXT("_lods_%d"), params.lodCount);
+	if (params.mergeLandsByBiom)
+	{
+		//the merge depends on where the bioms separate
+		key += TEXT("_merged");
+		for (float biomSeparation : params.biomSeparations)
+			key += FString::Printf(TEXT("_%g"), biomSeparation);
+	}
+	if (params.greedyTopMesh)
+		key += TEXT("_greedy");
+	if (params.visibleSurfaceOnly)
+		key += TEXT("_visible");
+	key += FString::Printf(TEXT("_weld_%g"), params.weldTolerance);
+
+	//the gradient channel is only kept in the tile when it is requested
+	if (params.storeNoiseGradient)
+		key += TEXT("_gradient");
+
+	if (params.streamChunks)
+	{
+		key += FString::Printf(TEXT("_chunk_%g_%g"), params.chunkNoiseRange.X, params.chunkNoiseRange.Y);
+	}
+	else
+	{
+		//the single map also depends on the river and on the landmarks it was flattened for
+		key += FString::Printf(TEXT("_map_%d_%d_%d"), params.AddRiver ? 1 : 0, params.riverWidthFactor, params.amountOfLandmarks);
+		for (TSubclassOf<ALandmark> landmark : params.potentialLandmarks)
+			key += TEXT("_") + (landmark ? landmark->GetName() : FString(TEXT("None")));
+	}
+
+	return key;
+}
+
+
+// Restores the level map and lands of a tile, the lands are added to outLands. Returns false if the tile was never generated
+bool AAMapGenerator::RestoreTileFromCache(FIntPoint tile, TArray<ALand*>& outLands)
+{
+	tileCache.Configure(tileCacheCapacity, diskTileCache);
+
+	FCachedTile cachedTile;
+	if (!tileCache.Find(GetTileCacheKey(tile), cachedTile) || cachedTile.levelMap.Num() != params.mapSize * params.mapSize)
+		return false;
+
+	generationState.levelMap = MoveTemp(cachedTile.levelMap);
+	generationState.noiseGradient = cachedTile.noiseGradient;
+
+	for (const FLandMeshData& land : cachedTile.lands)
+		outLands.Add(AAMapGenerator::SpawnLand(land));
+
+	return true;
+}
+
+
+// Copies the level map and the lands built for the map (or chunk) in a tile, before the lands are moved to their actors.
+// It only reads the generation state so it can run on any thread
+void AAMapGenerator::PrepareBuiltTile()
+{
+	builtTile = MakeShared<FCachedTile, ESPMode::ThreadSafe>();
+	builtTile->levelMap = generationState.levelMap;
+	builtTile->noiseGradient = generationState.noiseGradient;
+	builtTile->lands = generationState.builtLands;
+}
+
+
+// Hands the tile prepared for the map (or chunk) over to the cache, which writes it to disk in the background
+void AAMapGenerator::StoreBuiltTile(FIntPoint tile)
+{
+	if (!builtTile.IsValid())
+		return;
+
+	tileCache.Configure(tileCacheCapacity, diskTileCache);
+	tileCache.Add(GetTileCacheKey(tile), builtTile.ToSharedRef());
+	builtTile.Reset();
+}
+
+
+// Recycles the lands and landmarks of the previous map and removes its props and clouds
+void AAMapGenerator::ClearMap()
+{
+	for (ALand* land : meshes)
+		generationState.ReleaseLand(land);
+	meshes.Reset();
+
+	for (ALandmark* landmark : landmarks)
+		generationState.ReleaseLandmark(landmark);
+	landmarks.Reset();
+
+	//props come in many classes and move to their surface when spawned, so they are not pooled
+	for (AActor* prop : spawnedProps)
+	{
+		if (IsValid(prop))
+			prop->Destroy();
+	}
+	spawnedProps.Reset();
+
+	for (UStaticMeshComponent* cloud : cloudComponents)
+	{
+		if (IsValid(cloud))
+			cloud->DestroyComponent();
+	}
+	cloudComponents.Reset();
+	cloudsDistribution.Reset();
+	cloudsPosition.Reset();
+}
+
+
+ALand* AAMapGenerator::SpawnLand(FLandMeshData data)
+{
+	ALand* land = generationState.AcquireLand(GetWorld());
+	land->globalScale = params.globalScale;
+	land->biom = AAMapGenerator::GetLevelBiom(data.level);
+	land->SetMeshData(MoveTemp(data));
+	return land;
+}
+
+
+// Find which biom a terrace level is in
+ABiom* AAMapGenerator::GetLevelBiom(int level)
+{
+	return inGameBioms[AAMapGenerator::GetLevelBiomIndex(level)];
+}
+
+
+// Index in inGameBioms of the biom a terrace level is in
+int AAMapGenerator::GetLevelBiomIndex(int level)
+{
+	int itt = 0;
+	while (itt < params.biomSeparations.Num() - 1 && floor(params.biomSeparations[itt] * (params.mapLevels - 1)) < level)
+		itt++;
+
+	return itt;
+}
+
+
 // Uses the perlin noise generator to generate the terrain
 bool AAMapGenerator::GenerateNoise()
 {
-	//init the noise map to the right height
-	noiseMap = new float[mapSize * mapSize];
+	//size the buffers for the map, the gradient is filled in the same pass as the noise when requested
+	generationState.Reset(params.mapSize, params.storeNoiseGradient);
+
+	//Create Perlin Noise Generator. The legacy gradient table only covers a single map, so chunks always use the hashed lattice
+	PerlinNoiseGeneration noiseGenerator(params.seed, params.mapSize, params.octaves, params.persistance, params.baseFrequency, params.legacyNoise && !params.streamChunks);
+
+	//the map is split in bands of rows which are generated in parallel. Each pixel only depends on its
+	//coordinates, and the min/max are reduced per band then across bands, so the result does not depend on the thread count
+	int bandCount = FMath::DivideAndRoundUp(params.mapSize, noiseBandHeight);
+	TArray<float> bandMin = TArray<float>();
+	TArray<float> bandMax = TArray<float>();
+	bandMin.SetNumUninitialized(bandCount);
+	bandMax.SetNumUninitialized(bandCount);
+
+	//for each pixel generate a random value between 0 and the Number of plateau and normalize to values between 0 and 1
+	ParallelFor(bandCount, [&](int32 band)
+	{
+		int firstRow = band * noiseBandHeight;
+		AAMapGenerator::GenerateNoiseRows(noiseGenerator, firstRow, FMath::Min(firstRow + noiseBandHeight, params.mapSize), bandMin[band], bandMax[band]);
+	}, !params.multithreadedGeneration);
+
+	float minNoise = 100;
+	float maxNoise = -1;
+	for (int band = 0; band < bandCount; band++)
+	{
+		minNoise = FMath::Min(minNoise, bandMin[band]);
+		maxNoise = FMath::Max(maxNoise, bandMax[band]);
+	}
+
+	//chunks must all be normalized the same way for their seams to match
+	if (params.streamChunks)
+	{
+		minNoise = params.chunkNoiseRange.X;
+		maxNoise = params.chunkNoiseRange.Y;
+	}
+
+	//normalize noise and create river
+	ParallelFor(bandCount, [&](int32 band)
+	{
+		int firstRow = band * noiseBandHeight;
+		AAMapGenerator::NormalizeNoiseRows(firstRow, FMath::Min(firstRow + noiseBandHeight, params.mapSize), minNoise, maxNoise);
+	}, !params.multithreadedGeneration);
+
+	return true;
+}
 
-	//if we want a random seed, randomize the seed
-	if (randomSeed)
-		seed = rand();
 
-	//Create Perlin Noise Generator
-	PerlinNoiseGeneration noiseGenerator = PerlinNoiseGeneration(seed, mapSize, octaves, persistance, baseFrequency);
+// Fills the noise map rows in [firstRow, lastRow) and returns their min and max value
+void AAMapGenerator::GenerateNoiseRows(PerlinNoiseGeneration& noiseGenerator, int firstRow, int lastRow, float& minNoise, float& maxNoise)
+{
+	minNoise = 100;
+	maxNoise = -1;
 
-	float minNoise = 100;
-	float maxNoise = -1;
-	//for each pixel generate a random value between 0 and the Number of plateau and normalize to values between 0 and 1
-	for (int i = 0; i < mapSize; i++)
+	//derivatives along the rows and the columns of the current row
+	TArray<float> rowDerivative = TArray<float>();
+	TArray<float> columnDerivative = TArray<float>();
+	if (params.storeNoiseGradient)
+	{
+		rowDerivative.SetNumUninitialized(params.mapSize);
+		columnDerivative.SetNumUninitialized(params.mapSize);
+	}
+
+	for (int i = firstRow; i < lastRow; i++)
 	{
-		for (int j = 0; j < mapSize; j++) 
+		//noise is evaluated a whole row at a time
+		noiseGenerator.PerlinNoiseRow(i + noiseOffset.Y, noiseOffset.X, params.mapSize, &generationState.noiseMap[i * params.mapSize], params.vectorizedNoise,
+			params.storeNoiseGradient ? rowDerivative.GetData() : nullptr, params.storeNoiseGradient ? columnDerivative.GetData() : nullptr);
+
+		if (params.storeNoiseGradient)
 		{
-			noiseMap[i * mapSize + j] = noiseGenerator.PerlinNoiseValue(i,j);
+			for (int j = 0; j < params.mapSize; j++)
+				generationState.noiseGradient[i * params.mapSize + j] = FVector2D(columnDerivative[j], rowDerivative[j]);
+		}
 
+		for (int j = 0; j < params.mapSize; j++)
+		{
 			// Store the current max and min for latter normalisation
-			if (noiseMap[i * mapSize + j] > maxNoise) maxNoise = noiseMap[i * mapSize + j];
-			if (noiseMap[i * mapSize + j] < minNoise) minNoise = noiseMap[i * mapSize + j];
+			if (generationState.noiseMap[i * params.mapSize + j] > maxNoise) maxNoise = generationState.noiseMap[i * params.mapSize + j];
+			if (generationState.noiseMap[i * params.mapSize + j] < minNoise) minNoise = generationState.noiseMap[i * params.mapSize + j];
 		}
 	}
+}
 
-	//normalize noise and create river
-	for (int i = 0; i < mapSize; i++)
+
+// Normalizes the noise map rows in [firstRow, lastRow) and carves the river in them
+void AAMapGenerator::NormalizeNoiseRows(int firstRow, int lastRow, float minNoise, float maxNoise)
+{
+	for (int i = firstRow; i < lastRow; i++)
 	{
-		for (int j = 0; j < mapSize; j++)
+		for (int j = 0; j < params.mapSize; j++)
 		{
 			//normalize (with some power to allow extra control over terrian steepness)
-			noiseMap[i * mapSize + j] = FMath::Pow((noiseMap[i * mapSize + j] - minNoise) / (maxNoise - minNoise), noiseExponent);
+			float normalized = (generationState.noiseMap[i * params.mapSize + j] - minNoise) / (maxNoise - minNoise);
+			generationState.noiseMap[i * params.mapSize + j] = FMath::Pow(FMath::Clamp(normalized, 0.0f, 1.0f), params.noiseExponent);
+
+			//the gradient follows the same transform (chain rule), and is flat where the noise got clamped
+			if (params.storeNoiseGradient)
+			{
+				FVector2D& gradient = generationState.noiseGradient[i * params.mapSize + j];
+				if (normalized <= 0 || normalized >= 1)
+					gradient = FVector2D(0, 0);
+				else
+					gradient *= params.noiseExponent * FMath::Pow(normalized, params.noiseExponent - 1) / (maxNoise - minNoise);
+			}
 
 			//Add river by forcing the center of the map to go to 0
-			if (AddRiver) {
-				float distToCenterX = fmin(1, riverWidthFactor * abs(j - ((float)mapSize / 2.0)) / ((float)mapSize / 2.0));
-				noiseMap[i * mapSize + j] = noiseMap[i * mapSize + j] * distToCenterX;
+			if (params.AddRiver && !params.streamChunks) {
+				float distToCenterX = fmin(1, params.riverWidthFactor * abs(j - ((float)params.mapSize / 2.0)) / ((float)params.mapSize / 2.0));
+
+				//product rule, the river factor only varies along the columns
+				if (params.storeNoiseGradient)
+				{
+					float riverDerivative = 0;
+					if (distToCenterX < 1)
+						riverDerivative = params.riverWidthFactor * FMath::Sign(j - ((float)params.mapSize / 2.0)) / ((float)params.mapSize / 2.0);
+					FVector2D& gradient = generationState.noiseGradient[i * params.mapSize + j];
+					gradient = gradient * distToCenterX + FVector2D(generationState.noiseMap[i * params.mapSize + j] * riverDerivative, 0);
+				}
+
+				generationState.noiseMap[i * params.mapSize + j] = generationState.noiseMap[i * params.mapSize + j] * distToCenterX;
 			}
 		}
 	}
-
-	return true;
 }
 
 
-// Simply clips the noise to the floor int value in order to create some terraces
+// Simply clips the noise to the floor int value in order to create some terraces.
+// The levels are stored once in the level map, which replaces the float noise map for all later stages
 void AAMapGenerator::TerraceNoise()
 {
-	for (int i = 0; i < mapSize; i++)
+	AAMapGenerator::TerraceNoiseRows(0, params.mapSize);
+}
+
+
+// Terraces the rows in [firstRow, lastRow)
+void AAMapGenerator::TerraceNoiseRows(int firstRow, int lastRow)
+{
+	for (int i = firstRow; i < lastRow; i++)
 	{
-		for (int j = 0; j < mapSize; j++)
+		for (int j = 0; j < params.mapSize; j++)
 		{
 			//terrace
-			noiseMap[i * mapSize + j] = floor(noiseMap[i * mapSize + j] * (mapLevels - 1)) / (float)(mapLevels - 1);
+			generationState.levelMap[i * params.mapSize + j] = (uint8)FMath::Clamp((int)floor(generationState.noiseMap[i * params.mapSize + j] * (params.mapLevels - 1)), 0, params.mapLevels - 1);
 		}
 	}
 }
 
+// Stores for each level the mask of the pixels which are at that level or higher. The masks are split in islands afterwards
 void AAMapGenerator::ClusterNoise()
 {
-	//init arrays
-	clusters = TArray<TArray<TArray<FVector2D>>>();
-	for (int i = 0; i < mapLevels; i++) {
-		clusters.Add(TArray<TArray<FVector2D>>());
-	}
+	generationState.ResetLevelMasks(params.mapLevels);
 
-	//for each pixel of the map
-	for (int i = 0; i < mapSize; i++) {
-		for (int j = 0; j < mapSize; j++) {
+	for (int k = 0; k < params.mapLevels; k++)
+		AAMapGenerator::FillLevelMask(k);
+}
 
-			int noiseValue = (int)floor(noiseMap[i * mapSize + j] * (mapLevels - 1));
 
-			for (int k = 0; k <= noiseValue; k++)
-			{
-				//Add the new point in the right island
-				if (clusters[k].Num() > 0)
-				{
-					clusters[k][0].Add(FVector2D(j, i));
-					
-					// The below commented method separates the noise in actual clusters of adjacent points.
-					// This is not of use in this project anymore but might be useful latter
-					
-					//TArray<int> addedToList = TArray<int>();
-					//int idx = 0;
-
-					////if there already are some islands at that depth, look for islands containing neighbour and add to them
-					//for(int k = 0; k < clusters[noiseValue].Num(); k++)
-					//{
-					//	TArray<FVector2D> cluster = clusters[noiseValue][k];
-
-					//	//only test for pixels on left and top because the recursion starts from 0 and moves up
-					//	if (cluster.Contains(FVector2D(j-1, i)) || cluster.Contains(FVector2D(j, i - 1)))
-					//	{
-					//		//only add to the first found parent to avoid duplication of the vertex
-					//		if (addedToList.Num() == 0)
-					//			cluster.Add(FVector2D(j, i));
-					//		//still register as part of multiple clusters for future merging
-					//		addedToList.Add(idx);
-					//	}
-					//	idx++;
-					//}
-					//if (addedToList.Num() > 1)
-					//{
-					//	//if has neighbours in multiple clusters, merge clusters
-					//	for (int k = addedToList.Num() - 1; k > 0; k--)
-					//	{
-					//		clusters[noiseValue][addedToList[0]].Append(clusters[noiseValue][addedToList[k]]);
-					//		clusters[noiseValue].RemoveAt(addedToList[k]);
-					//	}
-					//}
-					//else if (addedToList.Num() == 0)
-					//{
-					//	//if was added to no cluster, it means it is in a new one
-					//	TArray<FVector2D> newCluster = TArray<FVector2D>();
-					//	newCluster.Add(FVector2D(j, i));
-					//	clusters[noiseValue].Add(newCluster);
-					//}
-				}
-				else
-				{
-					//if there is no cluster at that depth yet, add the point to a new island
-					TArray<FVector2D> newCluster = TArray<FVector2D>();
-					newCluster.Add(FVector2D(j, i));
-					clusters[k].Add(newCluster);
-				}
-			}
-		}
+// Sets the bits of the pixels which are at a level or higher in its (cleared) mask
+void AAMapGenerator::FillLevelMask(int level)
+{
+	TBitArray<>& mask = generationState.levelMasks[level];
+	for (int idx = 0; idx < params.mapSize * params.mapSize; idx++)
+	{
+		if (generationState.levelMap[idx] >= level)
+			mask[idx] = true;
 	}
 }
 
@@ -250,43 +879,178 @@ void AAMapGenerator::ClusterNoise()
 void AAMapGenerator::GenerateMesh()
 {
 	if (GEngine)
-		GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Green, TEXT("Adding top meshes"));
-	//Start by generating a top mesh for each cluster 
-	int depth = 0;
-	for (TArray<TArray<FVector2D>> cluster : clusters) {
-		for (TArray<FVector2D> points : cluster) {
-			meshes.Add(AAMapGenerator::GenerateTopMesh(points, depth));
-
-			//find which biom the mesh is in
-			int itt = 0;
-			while (floor(inGameBioms[itt]->biomSeparation * (mapLevels-1)) < depth)
-				itt++;
+		GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Green, TEXT("Adding meshes"));
+
+	AAMapGenerator::BuildLands();
 
-			meshes[meshes.Num() - 1]->biom = inGameBioms[itt];
+	//actors are only spawned on the game thread, once all the geometry is ready
+	for (FLandMeshData& land : generationState.builtLands)
+		meshes.Add(AAMapGenerator::SpawnLand(MoveTemp(land)));
+	generationState.builtLands.Reset();
+}
+
+
+// Builds the geometry of every land of the map in the generation state, without spawning anything
+void AAMapGenerator::BuildLands()
+{
+	TArray<FIntPoint> jobs = AAMapGenerator::GetLandJobs();
+
+	//the geometry of the lands is built in parallel. Each worker slot owns a vertex grid and takes the next free job until none is left,
+	//so a slot stuck on a large land doesn't hold back the jobs that would have been assigned to it
+	int slotCount = params.multithreadedGeneration ? FMath::Min(jobs.Num(), FTaskGraphInterface::Get().GetNumWorkerThreads() + 1) : 1;
+	generationState.ResetVertexGrids(slotCount);
+
+	//a job may give several lands when they are split in blocks
+	TArray<TArray<FLandMeshData>> jobLands = TArray<TArray<FLandMeshData>>();
+	jobLands.SetNum(jobs.Num());
+	FThreadSafeCounter nextJob;
+	ParallelFor(slotCount, [&](int32 slot)
+	{
+		for (int job = nextJob.Increment() - 1; job < jobs.Num(); job = nextJob.Increment() - 1)
+			jobLands[job] = AAMapGenerator::BuildLandData(jobs[job].X, jobs[job].Y, generationState.vertexGrids[slot]);
+	}, !params.multithreadedGeneration);
+
+	TArray<FLandMeshData>& lands = generationState.builtLands;
+	lands.Reset();
+	for (TArray<FLandMeshData>& landBlocks : jobLands)
+		lands.Append(MoveTemp(landBlocks));
+
+	if (params.mergeLandsByBiom)
+		AAMapGenerator::MergeLandsByBiom(lands);
+}
+
+
+// A land is built for each non empty level, or for each island of each level. Returns them as (level, island)
+TArray<FIntPoint> AAMapGenerator::GetLandJobs()
+{
+	TArray<FIntPoint> jobs = TArray<FIntPoint>();
+	for (int depth = 0; depth < generationState.levelMasks.Num(); depth++) {
+		if (params.meshPerIsland)
+		{
+			for (int island : generationState.levelIslands[depth])
+				jobs.Add(FIntPoint(depth, island));
+		}
+		else if (generationState.levelMasks[depth].Contains(true))
+		{
+			jobs.Add(FIntPoint(depth, -1));
 		}
-		depth++;
 	}
 
-	if (GEngine)
-		GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Green, TEXT("Extrude meshes"));
+	return jobs;
+}
 
-	//prepare extrusion matrices
-	TArray<float> extrudeHeight = TArray<float>();
-	extrudeHeight.Add(0);
-	extrudeHeight.Add(-heightScale);
 
-	//Then extrude each mesh
-	for (int i = 1; i < meshes.Num(); i++) {
-		meshes[i] = AAMapGenerator::PerformMeshExtrusion(meshes[i], extrudeHeight);
+// Builds the geometry of the land of a level (or of one of its islands), cut in blocks when requested.
+// It does not touch any actor so it can run on any thread
+TArray<FLandMeshData> AAMapGenerator::BuildLandData(int depth, int island, TArray<int32>& vertexGrid)
+{
+	FLandBuild build;
+	build.depth = depth;
+	build.island = island;
+	while (!AAMapGenerator::StepLandBuild(build, vertexGrid));
+
+	return MoveTemp(build.blocks);
+}
+
+
+// Runs the next phase of the build of a land: top mesh, boundary, optional simplification of the top, extrusion,
+// weld and scale for each level of detail, then the cut in blocks. Returns true once the land is done.
+// The vertex grid is filled by the top mesh and read by the simplification, so it must be left alone in between
+bool AAMapGenerator::StepLandBuild(FLandBuild& build, TArray<int32>& vertexGrid)
+{
+	//each level of detail halves the resolution of the grid the terraces are built from
+	int stride = 1 << build.lod;
+
+	switch (build.phase)
+	{
+	case ELandBuildPhase::Top:
+		build.mesh = AAMapGenerator::GenerateTopMesh(build.depth, build.island, vertexGrid, stride);
+		build.edges.Reset();
+		build.phase = ELandBuildPhase::Boundary;
+		break;
+
+	case ELandBuildPhase::Boundary:
+		//the lowest level is the ground and is not extruded, so it has no use for its boundary.
+		//The boundary is taken from the full triangulation, before the top gets simplified
+		if (build.depth > 0)
+			build.edges = MeshAdjacency(build.mesh.tris).GetBoundaryEdges();
+
+		//the border of a streamed chunk is shared with the next chunk, the level goes on there so it gets no wall
+		if (params.streamChunks && build.edges.Num() > 0)
+			AAMapGenerator::RemoveChunkBorderEdges(build.mesh, build.edges);
+
+		//an edge goes to the block of the triangle it bounds. The faces are only known until the vertices get compacted
+		if (build.lod == 0 && params.landBlockSize > 0)
+		{
+			build.edgeBlocks.Reset(build.edges.Num());
+			for (const FMeshEdge& edge : build.edges)
+			{
+				const TArray<int>& tris = build.mesh.tris;
+				FVector centroid = (build.mesh.verts[tris[3 * edge.face0]] + build.mesh.verts[tris[3 * edge.face0 + 1]]
+					+ build.mesh.verts[tris[3 * edge.face0 + 2]]) / 3.0f;
+				build.edgeBlocks.Add(AAMapGenerator::GetLandBlock(centroid * params.globalScale));
+			}
+		}
+		build.phase = ELandBuildPhase::Simplify;
+		break;
+
+	case ELandBuildPhase::Simplify:
+	{
+		if (params.visibleSurfaceOnly)
+			AAMapGenerator::CullHiddenTop(build.mesh, build.depth);
+
+		//the quads are merged on unit cells, so lower details keep their triangles
+		bool mergeQuads = params.greedyTopMesh && stride == 1;
+		if (mergeQuads)
+			AAMapGenerator::MergeTopQuads(build.mesh, build.edges, vertexGrid);
+
+		if (params.visibleSurfaceOnly || mergeQuads)
+			AAMapGenerator::CompactVertices(build.mesh, build.edges);
+		build.phase = ELandBuildPhase::Extrude;
+		break;
 	}
 
-	//finally scale meshes
-	for (int i = 0; i < meshes.Num(); i++) {
-		for (int j = 0; j < meshes[i]->verts.Num(); j++)
+	case ELandBuildPhase::Extrude:
+		if (build.depth > 0)
+		{
+			//prepare extrusion matrices
+			TArray<float> extrudeHeight = TArray<float>();
+			extrudeHeight.Add(0);
+			extrudeHeight.Add(-params.heightScale);
+			AAMapGenerator::PerformMeshExtrusion(build.mesh, extrudeHeight, build.edges);
+		}
+		build.phase = ELandBuildPhase::Weld;
+		break;
+
+	case ELandBuildPhase::Weld:
+		if (build.depth > 0)
+			AAMapGenerator::RemoveDuplicateVertices(build.mesh);
+
+		//finally scale mesh
+		for (int j = 0; j < build.mesh.verts.Num(); j++)
 		{
-			meshes[i]->verts[j] *= globalScale;
+			build.mesh.verts[j] *= params.globalScale;
 		}
+
+		if (build.lod == 0)
+			build.land = MoveTemp(build.mesh);
+		else
+			build.land.lods.Add(build.mesh.TakeGeometry());
+		build.mesh = FLandMeshData();
+
+		build.phase = ++build.lod < params.lodCount ? ELandBuildPhase::Top : ELandBuildPhase::Split;
+		break;
+
+	case ELandBuildPhase::Split:
+		build.blocks = AAMapGenerator::SplitLandInBlocks(MoveTemp(build.land), build.edgeBlocks);
+		build.phase = ELandBuildPhase::Done;
+		break;
+
+	default:
+		break;
 	}
+
+	return build.phase == ELandBuildPhase::Done;
 }
 
 // Randomly selects and spawns rocks, trees and clouds (and in the future, some pickups, collectibles and other resources)
@@ -306,15 +1070,23 @@ void AAMapGenerator::SpawnClouds()
 	if (GEngine)
 		GEngine->AddOnScreenDebugMessage(-1, 15.0f, FColor::Yellow, TEXT("Spawning Clouds"));
 
+	//remove the clouds of the previous generation
+	for (UStaticMeshComponent* cloud : cloudComponents)
+	{
+		if (IsValid(cloud))
+			cloud->DestroyComponent();
+	}
+	cloudComponents.Reset();
 
 	for (int i = 0; i < cloudsDistribution.Num(); i++) {
 		UStaticMeshComponent* newCloud = NewObject<UStaticMeshComponent>(this);
 		if (newCloud) {
 			newCloud->RegisterComponent();
-			newCloud->SetWorldLocation(cloudsPosition[i] * globalScale);
+			newCloud->SetWorldLocation(cloudsPosition[i] * params.globalScale);
 			newCloud->SetWorldScale3D(FVector(5, 5, 5));
 			newCloud->SetStaticMesh(cloudsDistribution[i]);
 			newCloud->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+			cloudComponents.Add(newCloud);
 		}
 	}
 }
@@ -324,22 +1096,22 @@ void AAMapGenerator::SpawnClouds()
 UTexture2D* AAMapGenerator::GenerateMapTexture(int resolution)
 {
 	//init the texture in 8 bit RGBA with the noise texture size
-	UTexture2D* mapTexture = UTexture2D::CreateTransient(mapSize, mapSize, PF_B8G8R8A8);
+	UTexture2D* mapTexture = UTexture2D::CreateTransient(params.mapSize, params.mapSize, PF_B8G8R8A8);
 	mapTexture->UpdateResource();
 
 	//create the map data
-	uint8* Data = new uint8[mapSize * mapSize * 4];
-	for (int y = 0; y < mapSize; y++)
+	uint8* Data = new uint8[params.mapSize * params.mapSize * 4];
+	for (int y = 0; y < params.mapSize; y++)
 	{
-		for (int x = 0; x < mapSize; x++) 
+		for (int x = 0; x < params.mapSize; x++) 
 		{
-			int location = x * mapSize + y;
+			int location = x * params.mapSize + y;
 			// Note that y is upside down compared to the noise map.
 			// That's why we use (mapSize - 1 - y) rather than mapsize
-			int imLocation = (mapSize - 1 - y) * mapSize + x;
+			int imLocation = (params.mapSize - 1 - y) * params.mapSize + x;
 
 			// the map color for each pixel is retrieved from the biom
-			FLinearColor color = meshes[(int)floor(noiseMap[location] * (mapLevels - 1))] -> biom -> biomMapColor;
+			FLinearColor color = AAMapGenerator::GetLevelBiom(generationState.levelMap[location]) -> biomMapColor;
 
 			//store pixel value
 			Data[imLocation * 4 + 0] = (uint8)(color.B * (uint8)255);
@@ -351,7 +1123,7 @@ UTexture2D* AAMapGenerator::GenerateMapTexture(int resolution)
 
 	// at this point we scale the map to match the desired resolution, by simple nearest neighbour
 	// interpolation. This way, no matter the map siwe, the minimap can have a similar size on screen
-	Data = ResampleMap(Data, mapSize, resolution);
+	Data = ResampleMap(Data, params.mapSize, resolution);
 
 	// If needed we can somewhat smooth the map to make it less shapr and pixelized
 	// We can also add an outline to create some sort of level lines
@@ -366,8 +1138,8 @@ UTexture2D* AAMapGenerator::GenerateMapTexture(int resolution)
 	Region->DestY = 0;
 	Region->SrcX = 0;
 	Region->SrcY = 0;
-	Region->Width = mapSize;
-	Region->Height = mapSize;
+	Region->Width = params.mapSize;
+	Region->Height = params.mapSize;
 
 	//create data cleanup function (UE4 memory management shenanigans here)
 	TFunction<void(uint8 * SrcData, const FUpdateTextureRegion2D * Regions)> DataCleanupFunc =
@@ -377,16 +1149,16 @@ UTexture2D* AAMapGenerator::GenerateMapTexture(int resolution)
 	};
 
 	//update texture
-	mapTexture->UpdateTextureRegions(0, 1, Region, mapSize * 4, 4, Data, DataCleanupFunc);
+	mapTexture->UpdateTextureRegions(0, 1, Region, params.mapSize * 4, 4, Data, DataCleanupFunc);
 
 	return mapTexture;
 }
 
-ALand* AAMapGenerator::GenerateTopMesh(TArray<FVector2D> points, int depth)
+FLandMeshData AAMapGenerator::GenerateTopMesh(int depth, int island, TArray<int32>& vertexGrid, int stride)
 {
-	//offset the map points so that the overall mesh is centered on 0,0
-	float leftCorner = ((float)mapSize - 1.0) / 2.0;
-	float topCorner = ((float)mapSize - 1.0) / 2.0;
+	//offset the map points so that the overall mesh is centered on 0,0 (or placed at its chunk location)
+	float leftCorner = -meshOffset.X;
+	float topCorner = -meshOffset.Y;
 
 	//Erode and Inflate to remove holes of size 1. Also Inflate one extra time so that no gap is left between clusters
 	//Inflate(points);
@@ -394,75 +1166,554 @@ ALand* AAMapGenerator::GenerateTopMesh(TArray<FVector2D> points, int depth)
 
 	
 	//init the struct
-	FActorSpawnParameters spawnParams;
-	ALand* mesh = GetWorld()->SpawnActor<ALand>(FVector(0, 0, 0), FRotator(0, 0, 0));
-	mesh->globalScale = globalScale;
+	FLandMeshData mesh;
+	mesh.level = depth;
+
+	//the grid of the stride is anchored to the world, so that chunks share it, and always keeps the border of the map
+	//so that adjacent chunks (and their levels of detail) meet on the same edge vertices.
+	//The previous and next kept coordinate of each column and row are the neighbours of a point, -1 past the map
+	TArray<int> previousColumn = TArray<int>();
+	TArray<int> nextColumn = TArray<int>();
+	TArray<int> previousRow = TArray<int>();
+	TArray<int> nextRow = TArray<int>();
+	TBitArray<> keptColumns = TBitArray<>(false, params.mapSize);
+	TBitArray<> keptRows = TBitArray<>(false, params.mapSize);
+	auto buildKeptCoordinates = [&](int offset, TBitArray<>& kept, TArray<int>& previous, TArray<int>& next) {
+		for (int c = 0; c < params.mapSize; c++)
+			kept[c] = c == 0 || c == params.mapSize - 1 || ((c + offset) % stride + stride) % stride == 0;
+
+		previous.Init(-1, params.mapSize);
+		next.Init(-1, params.mapSize);
+		int last = -1;
+		for (int c = 0; c < params.mapSize; c++)
+		{
+			previous[c] = last;
+			if (kept[c])
+				last = c;
+		}
+		last = -1;
+		for (int c = params.mapSize - 1; c >= 0; c--)
+		{
+			next[c] = last;
+			if (kept[c])
+				last = c;
+		}
+	};
+	buildKeptCoordinates(noiseOffset.X, keptColumns, previousColumn, nextColumn);
+	buildKeptCoordinates(noiseOffset.Y, keptRows, previousRow, nextRow);
 
-	//for each point add a vertex, a corresponding uv point and up to 2 triangles
+	//points of the level (or of the island) on the grid of the stride, in the order of their vertices
+	TArray<FIntPoint> points = TArray<FIntPoint>();
+	if (island < 0)
+	{
+		for (TConstSetBitIterator<> pixel = generationState.LevelPixels(depth); pixel; ++pixel)
+		{
+			FIntPoint point = FIntPoint(pixel.GetIndex() % params.mapSize, pixel.GetIndex() / params.mapSize);
+			if (keptColumns[point.X] && keptRows[point.Y])
+				points.Add(point);
+		}
+	}
+	else
+	{
+		const FIntRect& bounds = generationState.islands[island].bounds;
+		for (int y = bounds.Min.Y; y < bounds.Max.Y; y++)
+		{
+			if (!keptRows[y])
+				continue;
+			for (int x = bounds.Min.X; x < bounds.Max.X; x++)
+			{
+				if (keptColumns[x] && generationState.IsInLevel(depth, x, y) && generationState.GetIslandAtLevel(y * params.mapSize + x, depth) == island)
+					points.Add(FIntPoint(x, y));
+			}
+		}
+	}
+
+	//register the vertex of each point in the grid first, as triangles point to vertices of the next row
 	int n = points.Num();
+	for (int i = 0; i < n; i++)
+		vertexGrid[points[i].Y * params.mapSize + points[i].X] = i;
+
+	//vertex of a map point, INDEX_NONE if the point is not in the mesh.
+	//Triangles only join pixels which are 4-connected, so when meshing an island the neighbours found are in the island
+	auto vertexAt = [&](int x, int y) {
+		return (x >= 0 && y >= 0 && x < params.mapSize && y < params.mapSize) ? vertexGrid[y * params.mapSize + x] : INDEX_NONE;
+	};
+
+	mesh.verts.Reserve(n);
+	mesh.uvs.Reserve(n);
+	mesh.tris.Reserve(n * 6);
+
+	//for each point add a vertex, a corresponding uv point and up to 2 triangles
 	for (int i = 0; i < n; i++)
 	{
-		float x = points[i].X;
-		float y = points[i].Y;
+		int x = points[i].X;
+		int y = points[i].Y;
 
-		mesh->verts.Add(FVector(x - leftCorner, y - topCorner, depth * heightScale));
-		mesh->uvs.Add(FVector2D(x / (float)mapSize, y / (float)mapSize));
+		mesh.verts.Add(FVector(x - leftCorner, y - topCorner, depth * params.heightScale));
+		mesh.uvs.Add(FVector2D(x / (float)params.mapSize, y / (float)params.mapSize));
 
-		// Look at the adjacent points on the map grid and if the point is also in the input
-		// TArray of point, connect it. We do that with 2 adjacent neighbours at a time so that we can
+		int below = vertexAt(x, nextRow[y]);
+		int right = vertexAt(nextColumn[x], y);
+		int belowRight = vertexAt(nextColumn[x], nextRow[y]);
+		int belowLeft = vertexAt(previousColumn[x], nextRow[y]);
+		int left = vertexAt(previousColumn[x], y);
+
+		// Look at the adjacent points on the map grid and if the point is also in the mesh, connect it.
+		// We do that with 2 adjacent neighbours at a time so that we can
 		// set the points in the right order for the tris, the order influencing the side of the normal
-		if (points.Contains(FVector2D(x, y + 1)) && points.Contains(FVector2D(x + 1, y)))
+		if (below != INDEX_NONE && right != INDEX_NONE)
+		{
+			mesh.tris.Add(i);
+			mesh.tris.Add(below);
+			mesh.tris.Add(right);
+		}
+		else if (belowRight != INDEX_NONE && below != INDEX_NONE)
+		{
+			mesh.tris.Add(i);
+			mesh.tris.Add(below);
+			mesh.tris.Add(belowRight);
+		}
+		if (belowLeft != INDEX_NONE && below != INDEX_NONE)
+		{
+			mesh.tris.Add(i);
+			mesh.tris.Add(belowLeft);
+			mesh.tris.Add(below);
+		}
+		else if (left != INDEX_NONE && below != INDEX_NONE)
+		{
+			mesh.tris.Add(i);
+			mesh.tris.Add(left);
+			mesh.tris.Add(below);
+		}
+	}
+
+	//the top is flat and its u coordinate follows x
+	mesh.normals.Init(FVector::UpVector, n);
+	mesh.tangents.Init(FVector::ForwardVector, n);
+
+	//leave the grid empty for the next mesh, only touching the points of this one
+	for (const FIntPoint& point : points)
+		vertexGrid[point.Y * params.mapSize + point.X] = INDEX_NONE;
+
+	return mesh;
+}
+
+// Merges the lands which share a biom (and a block when lands are split in blocks) into a single land each,
+// so that there is one mesh section per biom rather than one per level. The merged land keeps the lowest level
+void AAMapGenerator::MergeLandsByBiom(TArray<FLandMeshData>& lands)
+{
+	//index in merged of the land of each (biom, block)
+	TMap<TPair<int, FIntPoint>, int> mergedIndices = TMap<TPair<int, FIntPoint>, int>();
+	TArray<FLandMeshData> merged = TArray<FLandMeshData>();
+
+	for (FLandMeshData& land : lands)
+	{
+		TPair<int, FIntPoint> key = TPair<int, FIntPoint>(AAMapGenerator::GetLevelBiomIndex(land.level), land.block);
+		int* index = mergedIndices.Find(key);
+		if (!index)
+		{
+			mergedIndices.Add(key, merged.Num());
+			merged.Add(MoveTemp(land));
+			continue;
+		}
+
+		FLandMeshData& target = merged[*index];
+		target.level = FMath::Min(target.level, land.level);
+		target.bounds += land.bounds;
+		target.edges.Append(land.edges);
+		FLandLOD geometry = target.TakeGeometry();
+		AAMapGenerator::AppendGeometry(geometry, land.TakeGeometry());
+		target.SetGeometry(MoveTemp(geometry));
+
+		target.lods.SetNum(FMath::Max(target.lods.Num(), land.lods.Num()));
+		for (int lod = 0; lod < land.lods.Num(); lod++)
+			AAMapGenerator::AppendGeometry(target.lods[lod], land.lods[lod]);
+	}
+
+	lands = MoveTemp(merged);
+}
+
+
+// Appends a mesh to another one, shifting its indices past the vertices already there
+void AAMapGenerator::AppendGeometry(FLandLOD& geometry, const FLandLOD& other)
+{
+	int offset = geometry.verts.Num();
+	geometry.verts.Append(other.verts);
+	geometry.uvs.Append(other.uvs);
+	geometry.normals.Append(other.normals);
+	geometry.tangents.Append(other.tangents);
+
+	geometry.tris.Reserve(geometry.tris.Num() + other.tris.Num());
+	for (int idx : other.tris)
+		geometry.tris.Add(idx + offset);
+}
+
+
+// Cuts a land in square blocks of landBlockSize pixels. Each triangle goes to the block of its centroid and each
+// block gets its own copy of the vertices it uses, so the blocks can be rendered and culled on their own.
+// Every level of detail is cut along the same blocks
+TArray<FLandMeshData> AAMapGenerator::SplitLandInBlocks(FLandMeshData&& land, const TArray<FIntPoint>& edgeBlocks)
+{
+	TArray<FLandMeshData> blocks = TArray<FLandMeshData>();
+
+	if (params.landBlockSize <= 0)
+	{
+		land.bounds = FBox(land.verts);
+		for (const FLandLOD& lod : land.lods)
+			land.bounds += FBox(lod.verts);
+		blocks.Add(MoveTemp(land));
+		return blocks;
+	}
+
+	//index in blocks of each block of the map
+	TMap<FIntPoint, int> blockIndices = TMap<FIntPoint, int>();
+	auto getBlock = [&](FIntPoint block) {
+		int* index = blockIndices.Find(block);
+		if (index)
+			return *index;
+
+		FLandMeshData& data = blocks.AddDefaulted_GetRef();
+		data.level = land.level;
+		data.block = block;
+		data.lods.SetNum(land.lods.Num());
+		return blockIndices.Add(block, blocks.Num() - 1);
+	};
+
+	TMap<FIntPoint, FLandLOD> geometry = TMap<FIntPoint, FLandLOD>();
+	AAMapGenerator::SplitGeometryInBlocks(land.TakeGeometry(), geometry);
+	for (TPair<FIntPoint, FLandLOD>& block : geometry)
+		blocks[getBlock(block.Key)].SetGeometry(MoveTemp(block.Value));
+
+	//a coarse triangle may fall in a block the full resolution land does not reach, which then only has lower details
+	for (int lod = 0; lod < land.lods.Num(); lod++)
+	{
+		geometry.Reset();
+		AAMapGenerator::SplitGeometryInBlocks(land.lods[lod], geometry);
+		for (TPair<FIntPoint, FLandLOD>& block : geometry)
+			blocks[getBlock(block.Key)].lods[lod] = MoveTemp(block.Value);
+	}
+
+	for (FLandMeshData& data : blocks)
+	{
+		data.bounds = FBox(data.verts);
+		for (const FLandLOD& lod : data.lods)
+			data.bounds += FBox(lod.verts);
+	}
+
+	//edges are stored as pairs of points and go to the block of the face they bound (given in the same order).
+	//An edge with no triangle in its block is dropped
+	for (int e = 0; e + 1 < land.edges.Num() && e / 2 < edgeBlocks.Num(); e += 2)
+	{
+		int* index = blockIndices.Find(edgeBlocks[e / 2]);
+		if (index)
 		{
-			int j = points.Find(FVector2D(x, y + 1));
-			int k = points.Find(FVector2D(x + 1, y));
+			blocks[*index].edges.Add(land.edges[e]);
+			blocks[*index].edges.Add(land.edges[e + 1]);
+		}
+	}
+
+	return blocks;
+}
+
+
+// Block of a point of a (scaled) land, counted from the corner of the map
+FIntPoint AAMapGenerator::GetLandBlock(const FVector& point)
+{
+	FVector2D pixel = FVector2D(point.X, point.Y) / params.globalScale - meshOffset;
+	return FIntPoint(FMath::FloorToInt(pixel.X / params.landBlockSize), FMath::FloorToInt(pixel.Y / params.landBlockSize));
+}
+
+
+// Splits a triangle mesh in the blocks of the centroids of its triangles, remapping the vertices of each block
+void AAMapGenerator::SplitGeometryInBlocks(const FLandLOD& geometry, TMap<FIntPoint, FLandLOD>& outBlocks)
+{
+	const TArray<FVector>& verts = geometry.verts;
+	const TArray<int>& tris = geometry.tris;
+
+	//triangles of each block, in their original order
+	TMap<FIntPoint, TArray<int>> blockTriangles = TMap<FIntPoint, TArray<int>>();
+	for (int t = 0; t < tris.Num() / 3; t++)
+	{
+		FVector centroid = (verts[tris[3 * t]] + verts[tris[3 * t + 1]] + verts[tris[3 * t + 2]]) / 3.0f;
+		blockTriangles.FindOrAdd(AAMapGenerator::GetLandBlock(centroid)).Add(t);
+	}
+
+	//vertex of each input vertex in the block being filled. Only the entries of that block are reset afterwards
+	TArray<int32> remap = TArray<int32>();
+	remap.Init(INDEX_NONE, verts.Num());
+
+	for (const TPair<FIntPoint, TArray<int>>& block : blockTriangles)
+	{
+		FLandLOD& data = outBlocks.Add(block.Key);
+		data.tris.Reserve(block.Value.Num() * 3);
+
+		for (int t : block.Value)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				int idx = tris[3 * t + k];
+				if (remap[idx] == INDEX_NONE)
+				{
+					remap[idx] = data.verts.Add(verts[idx]);
+					data.uvs.Add(geometry.uvs[idx]);
+					data.normals.Add(geometry.normals[idx]);
+					data.tangents.Add(geometry.tangents[idx]);
+				}
+				data.tris.Add(remap[idx]);
+			}
+		}
 
-			mesh->tris.Add(i);
-			mesh->tris.Add(j);
-			mesh->tris.Add(k);
+		for (int t : block.Value)
+		{
+			for (int k = 0; k < 3; k++)
+				remap[tris[3 * t + k]] = INDEX_NONE;
 		}
-		else if (points.Contains(FVector2D(x + 1, y + 1)) && points.Contains(FVector2D(x, y + 1)))
+	}
+}
+
+
+// Grid coordinates of the vertices of a top mesh, which lie on the map grid in row order
+TArray<FIntPoint> AAMapGenerator::GetTopMeshPoints(const FLandMeshData& mesh)
+{
+	TArray<FIntPoint> points = TArray<FIntPoint>();
+	points.SetNumUninitialized(mesh.verts.Num());
+	for (int i = 0; i < mesh.verts.Num(); i++)
+		points[i] = FIntPoint(FMath::RoundToInt(mesh.verts[i].X - meshOffset.X), FMath::RoundToInt(mesh.verts[i].Y - meshOffset.Y));
+
+	return points;
+}
+
+
+// Removes the boundary edges of a top mesh which run along the border row or column of the map
+void AAMapGenerator::RemoveChunkBorderEdges(const FLandMeshData& mesh, TArray<FMeshEdge>& edges)
+{
+	TArray<FIntPoint> points = AAMapGenerator::GetTopMeshPoints(mesh);
+	auto isBorder = [&](int coordinate) {
+		return coordinate == 0 || coordinate == params.mapSize - 1;
+	};
+
+	edges.RemoveAll([&](const FMeshEdge& edge) {
+		const FIntPoint& a = points[edge.v0];
+		const FIntPoint& b = points[edge.v1];
+		return (a.X == b.X && isBorder(a.X)) || (a.Y == b.Y && isBorder(a.Y));
+	});
+}
+
+
+// Removes the triangles of a top mesh which are hidden under the level above, i.e. whose vertices are all at a higher level.
+// The level above is triangulated the same way on those points so this never opens a hole
+void AAMapGenerator::CullHiddenTop(FLandMeshData& mesh, int depth)
+{
+	if (depth + 1 >= generationState.levelMasks.Num())
+		return;
+
+	TArray<FIntPoint> points = AAMapGenerator::GetTopMeshPoints(mesh);
+
+	int triCount = 0;
+	for (int t = 0; t < mesh.tris.Num(); t += 3)
+	{
+		bool hidden = true;
+		for (int k = 0; k < 3 && hidden; k++)
 		{
-			int k = points.Find(FVector2D(x + 1, y + 1));
-			int j = points.Find(FVector2D(x, y + 1));
+			const FIntPoint& point = points[mesh.tris[t + k]];
+			hidden = generationState.IsInLevel(depth + 1, point.X, point.Y);
+		}
 
-			mesh->tris.Add(i);
-			mesh->tris.Add(j);
-			mesh->tris.Add(k);
+		if (!hidden)
+		{
+			mesh.tris[triCount++] = mesh.tris[t];
+			mesh.tris[triCount++] = mesh.tris[t + 1];
+			mesh.tris[triCount++] = mesh.tris[t + 2];
 		}
-		if (points.Contains(FVector2D(x - 1, y + 1)) && points.Contains(FVector2D(x, y + 1)))
+	}
+	mesh.tris.SetNum(triCount, false);
+}
+
+
+// Replaces the two triangles of every full cell of a top mesh by as few rectangles as possible (greedy meshing).
+// Cells which only have one triangle keep it, and so do the cells touching the boundary. Vertices left unused are removed
+// later by CompactVertices
+void AAMapGenerator::MergeTopQuads(FLandMeshData& mesh, const TArray<FMeshEdge>& edges, TArray<int32>& vertexGrid)
+{
+	TArray<FIntPoint> points = AAMapGenerator::GetTopMeshPoints(mesh);
+	int n = points.Num();
+	for (int i = 0; i < n; i++)
+		vertexGrid[points[i].Y * params.mapSize + points[i].X] = i;
+
+	auto vertexAt = [&](int x, int y) {
+		return (x >= 0 && y >= 0 && x < params.mapSize && y < params.mapSize) ? vertexGrid[y * params.mapSize + x] : INDEX_NONE;
+	};
+
+	//the walls are extruded with a vertex per pixel of the boundary, so a rectangle reaching it would leave T-junctions
+	//along the crease between the top and the walls. The same goes for the border of a streamed chunk, which the next
+	//chunk meshes with its own vertices
+	TBitArray<> rimVertices = TBitArray<>(false, n);
+	for (const FMeshEdge& edge : edges)
+	{
+		rimVertices[edge.v0] = true;
+		rimVertices[edge.v1] = true;
+	}
+	if (params.streamChunks)
+	{
+		for (int i = 0; i < n; i++)
 		{
-			int j = points.Find(FVector2D(x - 1, y + 1));
-			int k = points.Find(FVector2D(x, y + 1));
+			if (points[i].X == 0 || points[i].Y == 0 || points[i].X == params.mapSize - 1 || points[i].Y == params.mapSize - 1)
+				rimVertices[i] = true;
+		}
+	}
+	auto isInnerVertex = [&](int x, int y) {
+		int idx = vertexAt(x, y);
+		return idx != INDEX_NONE && !rimVertices[idx];
+	};
+
+	//a cell with its 4 corners is covered by the triangles (v00, v01, v10) and (v10, v01, v11). It is full when both are
+	//still in the mesh (hidden triangles might have been removed) and none of its corners is on the rim
+	TBitArray<> halfCells = TBitArray<>(false, params.mapSize * params.mapSize);
+	TBitArray<> fullCells = TBitArray<>(false, params.mapSize * params.mapSize);
+	auto triangleCell = [&](int t) {
+		FIntPoint a = points[mesh.tris[t]];
+		FIntPoint b = points[mesh.tris[t + 1]];
+		FIntPoint c = points[mesh.tris[t + 2]];
+		return FIntPoint(FMath::Min3(a.X, b.X, c.X), FMath::Min3(a.Y, b.Y, c.Y));
+	};
+	for (int t = 0; t < mesh.tris.Num(); t += 3)
+	{
+		FIntPoint cell = triangleCell(t);
+		if (!isInnerVertex(cell.X, cell.Y) || !isInnerVertex(cell.X + 1, cell.Y)
+			|| !isInnerVertex(cell.X, cell.Y + 1) || !isInnerVertex(cell.X + 1, cell.Y + 1))
+			continue;
+
+		int idx = cell.Y * params.mapSize + cell.X;
+		if (halfCells[idx])
+			fullCells[idx] = true;
+		else
+			halfCells[idx] = true;
+	}
+
+	auto isFullCell = [&](int x, int y) {
+		return x >= 0 && y >= 0 && x < params.mapSize - 1 && y < params.mapSize - 1 && fullCells[y * params.mapSize + x];
+	};
+
+	TArray<int> tris = TArray<int>();
+	tris.Reserve(mesh.tris.Num());
 
-			mesh->tris.Add(i);
-			mesh->tris.Add(j);
-			mesh->tris.Add(k);
+	//keep the triangles of the cells which are not full
+	for (int t = 0; t < mesh.tris.Num(); t += 3)
+	{
+		FIntPoint cell = triangleCell(t);
+		if (!isFullCell(cell.X, cell.Y))
+		{
+			tris.Add(mesh.tris[t]);
+			tris.Add(mesh.tris[t + 1]);
+			tris.Add(mesh.tris[t + 2]);
 		}
-		else if (points.Contains(FVector2D(x - 1, y)) && points.Contains(FVector2D(x, y + 1)))
+	}
+
+	//grow rectangles of full cells, first along the row then down as long as the whole span is full.
+	//Cells are visited from their top left corner, in row order
+	TBitArray<> merged = TBitArray<>(false, params.mapSize * params.mapSize);
+	for (int i = 0; i < n; i++)
+	{
+		int x = points[i].X;
+		int y = points[i].Y;
+		if (!isFullCell(x, y) || merged[y * params.mapSize + x])
+			continue;
+
+		int width = 1;
+		while (isFullCell(x + width, y) && !merged[y * params.mapSize + x + width])
+			width++;
+
+		int height = 1;
+		bool canGrow = true;
+		while (canGrow)
 		{
-			int j = points.Find(FVector2D(x - 1, y));
-			int k = points.Find(FVector2D(x, y + 1));
+			for (int k = 0; k < width && canGrow; k++)
+				canGrow = isFullCell(x + k, y + height) && !merged[(y + height) * params.mapSize + x + k];
+			if (canGrow)
+				height++;
+		}
 
-			mesh->tris.Add(i);
-			mesh->tris.Add(j);
-			mesh->tris.Add(k);
+		for (int v = 0; v < height; v++)
+		{
+			for (int u = 0; u < width; u++)
+				merged[(y + v) * params.mapSize + x + u] = true;
 		}
+
+		int v00 = vertexAt(x, y);
+		int v10 = vertexAt(x + width, y);
+		int v01 = vertexAt(x, y + height);
+		int v11 = vertexAt(x + width, y + height);
+
+		tris.Add(v00);
+		tris.Add(v01);
+		tris.Add(v10);
+		tris.Add(v10);
+		tris.Add(v01);
+		tris.Add(v11);
 	}
 
-	return mesh;
+	//leave the grid empty for the next mesh
+	for (const FIntPoint& point : points)
+		vertexGrid[point.Y * params.mapSize + point.X] = INDEX_NONE;
+
+	mesh.tris = MoveTemp(tris);
+}
+
+
+// Removes the vertices which are neither used by a triangle nor by the boundary, and remaps both
+void AAMapGenerator::CompactVertices(FLandMeshData& mesh, TArray<FMeshEdge>& edges)
+{
+	int n = mesh.verts.Num();
+
+	TArray<int> remap = TArray<int>();
+	remap.Init(INDEX_NONE, n);
+	for (int idx : mesh.tris)
+		remap[idx] = 0;
+	for (const FMeshEdge& edge : edges)
+	{
+		remap[edge.v0] = 0;
+		remap[edge.v1] = 0;
+	}
+
+	int vertCount = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (remap[i] == INDEX_NONE)
+			continue;
+
+		remap[i] = vertCount;
+		mesh.verts[vertCount] = mesh.verts[i];
+		mesh.uvs[vertCount] = mesh.uvs[i];
+		mesh.normals[vertCount] = mesh.normals[i];
+		mesh.tangents[vertCount] = mesh.tangents[i];
+		vertCount++;
+	}
+	mesh.verts.SetNum(vertCount, false);
+	mesh.uvs.SetNum(vertCount, false);
+	mesh.normals.SetNum(vertCount, false);
+	mesh.tangents.SetNum(vertCount, false);
+
+	for (int& idx : mesh.tris)
+		idx = remap[idx];
+
+	//face indices of the edges referred to the full triangulation and are not meaningful anymore
+	for (FMeshEdge& edge : edges)
+	{
+		edge.v0 = remap[edge.v0];
+		edge.v1 = remap[edge.v1];
+	}
 }
 
+
 // Store edges (stored as a TArray of edge object) as a Tarray of vertices 
-ALand* AAMapGenerator::StoreEdge(ALand* mesh, TArray<FEdgeData> edges)
+void AAMapGenerator::StoreEdge(FLandMeshData& mesh, const TArray<FMeshEdge>& edges)
 {
-	mesh->edges = TArray<FVector>();
+	mesh.edges = TArray<FVector>();
 
-	for (FEdgeData edge : edges) {
-		mesh->edges.Add(mesh->verts[(int)edge.vertexIndex.X] * globalScale);
-		mesh->edges.Add(mesh->verts[(int)edge.vertexIndex.Y] * globalScale);
+	for (const FMeshEdge& edge : edges) {
+		mesh.edges.Add(mesh.verts[edge.v0] * params.globalScale);
+		mesh.edges.Add(mesh.verts[edge.v1] * params.globalScale);
 	}
-
-	return mesh;
 }
 
 
@@ -500,21 +1751,21 @@ void AAMapGenerator::Inflate(TArray<FVector2D>& points)
 	for (FVector2D point : points)
 		{
 			if (!points.Contains(FVector2D(point.X + 1, point.Y)) && !buffer.Contains(FVector2D(point.X + 1, point.Y))
-				&& noiseMap[(int)(point.Y * mapSize + point.X)] > noiseMap[int(point.Y * mapSize + (point.X+1))]) {
+				&& generationState.levelMap[(int)(point.Y * params.mapSize + point.X)] > generationState.levelMap[int(point.Y * params.mapSize + (point.X+1))]) {
 				buffer.Add(FVector2D(point.X + 1, point.Y));
 			}
 			if (!points.Contains(FVector2D(point.X - 1, point.Y)) && !buffer.Contains(FVector2D(point.X - 1, point.Y))
-				&& noiseMap[(int)(point.Y * mapSize + point.X)] > noiseMap[int(point.Y * mapSize + (point.X - 1))])
+				&& generationState.levelMap[(int)(point.Y * params.mapSize + point.X)] > generationState.levelMap[int(point.Y * params.mapSize + (point.X - 1))])
 			{
 				buffer.Add(FVector2D(point.X - 1, point.Y));
 			}
 			if (!points.Contains(FVector2D(point.X, point.Y + 1)) && !buffer.Contains(FVector2D(point.X, point.Y + 1))
-				&& noiseMap[(int)(point.Y * mapSize + point.X)] > noiseMap[int((point.Y + 1) * mapSize + point.X)])
+				&& generationState.levelMap[(int)(point.Y * params.mapSize + point.X)] > generationState.levelMap[int((point.Y + 1) * params.mapSize + point.X)])
 			{
 				buffer.Add(FVector2D(point.X, point.Y + 1));
 			}
 			if (!points.Contains(FVector2D(point.X, point.Y - 1)) && !buffer.Contains(FVector2D(point.X, point.Y - 1))
-				&& noiseMap[(int)(point.Y * mapSize + point.X)] > noiseMap[int((point.Y - 1) * mapSize + point.X)])
+				&& generationState.levelMap[(int)(point.Y * params.mapSize + point.X)] > generationState.levelMap[int((point.Y - 1) * params.mapSize + point.X)])
 			{
 				buffer.Add(FVector2D(point.X, point.Y - 1));
 			}
@@ -567,8 +1818,8 @@ void AAMapGenerator::clampMap(TArray<FVector2D>& points)
 {
 	int i = 0;
 	while (i < points.Num()) {
-		if (points[i].X < 0 || points[i].X > (float)mapSize - 1
-			|| points[i].Y < 0 || points[i].Y > (float)mapSize - 1)
+		if (points[i].X < 0 || points[i].X > (float)params.mapSize - 1
+			|| points[i].Y < 0 || points[i].Y > (float)params.mapSize - 1)
 			points.RemoveAt(i);
 		else
 			i++;
@@ -577,213 +1828,149 @@ void AAMapGenerator::clampMap(TArray<FVector2D>& points)
 
 
 // Disclaimer: major parts of the extrusion process where picked off stackoverflow
-// after hours of fighting faulty normal orientations. This is the case for the following function
-TArray<FEdgeData> AAMapGenerator::BuildEdge(int vertexCount, TArray<int> triangleArray)
+// after hours of fighting faulty normal orientations.This is the case for the following function
+void AAMapGenerator::ExtrudeMesh(FLandMeshData& mesh, const TArray<float>& extrusion, const TArray<FMeshEdge>& edges, bool invertFaces, bool bottomCap)
 {
-	TArray<FEdgeData> Edges = TArray<FEdgeData>();
-
-	int maxEdgeCount = triangleArray.Num();
-	int* firstEdge = new int[vertexCount + maxEdgeCount];
-	int nextEdge = vertexCount;
-	int triangleCount = triangleArray.Num() / 3;
-
-	for (int a = 0; a < vertexCount; a++)
-		firstEdge[a] = -1;
+	int extrudedVertexCount = edges.Num() * 2 * extrusion.Num();
+	int triIndicesPerStep = edges.Num() * 6;
+	int extrudedTriIndexCount = triIndicesPerStep * (extrusion.Num() - 1);
 
-	// First pass over all triangles. This finds all the edges satisfying the
-	// condition that the first vertex index is less than the second vertex index
-	// when the direction from the first vertex to the second vertex represents
-	// a counterclockwise winding around the triangle to which the edge belongs.
-	// For each edge found, the edge index is stored in a linked list of edges
-	// belonging to the lower-numbered vertex index i. This allows us to quickly
-	// find an edge in the second pass whose higher-numbered vertex index is i.
-	FEdgeData* edgeArray = new FEdgeData[maxEdgeCount];
+	//the input is read in place, the output is written in presized arrays which are moved into the mesh at the end
+	const TArray<FVector>& inputVertices = mesh.verts;
+	const TArray<FVector2D>& inputUV = mesh.uvs;
+	const TArray<int>& inputTriangles = mesh.tris;
+
+	//the bottom cap can be skipped when it is known to be hidden
+	int capCount = bottomCap ? 2 : 1;
+
+	int vertCount = extrudedVertexCount + inputVertices.Num() * capCount;
+	int triangleCount = extrudedTriIndexCount + inputTriangles.Num() * capCount;
+
+	TArray<FVector> vertices = TArray<FVector>();
+	TArray<FVector2D> uvs = TArray<FVector2D>();
+	TArray<FVector> normals = TArray<FVector>();
+	TArray<FVector> tangents = TArray<FVector>();
+	TArray<int> triangles = TArray<int>();
+	vertices.SetNumUninitialized(vertCount);
+	uvs.SetNumUninitialized(vertCount);
+	normals.SetNumUninitialized(vertCount);
+	tangents.SetNumUninitialized(vertCount);
+	triangles.SetNumUninitialized(triangleCount);
+
+	//the boundary edges follow the winding of the top, so a wall extruded downwards faces away from the land.
+	//Walls are flat so their normal and tangent are known from their edge alone
+	float wallSide = extrusion.Last() <= extrusion[0] ? 1.0f : -1.0f;
+	if (invertFaces)
+		wallSide = -wallSide;
+	//the normal follows the winding of the edge, the tangent follows the wall UVs (u = x / mapSize) so it can point against the edge
+	auto edgeDirection = [&](const FMeshEdge& edge) {
+		return (inputVertices[edge.v1] - inputVertices[edge.v0]).GetSafeNormal2D();
+	};
+	auto edgeTangent = [&](const FMeshEdge& edge) {
+		FVector edgeDelta = inputVertices[edge.v1] - inputVertices[edge.v0];
+		float uDelta = inputUV[edge.v1].X - inputUV[edge.v0].X;
+		FVector tangent = uDelta < 0 ? -edgeDirection(edge) : edgeDirection(edge);
+		//an edge along Y keeps the same u, any direction along it is fine
+		checkSlow(uDelta == 0 || FVector::DotProduct(tangent, edgeDelta / uDelta) > 0);
+		return tangent;
+	};
+	auto wallNormal = [&](const FMeshEdge& edge) {
+		FVector direction = edgeDirection(edge);
+		return FVector(-direction.Y, direction.X, 0) * wallSide;
+	};
 
-	int edgeCount = 0;
-	for (int a = 0; a < triangleCount; a++)
+	if (extrusion.Num() == 2 && extrusion[0] == 0)
 	{
-		int i1 = triangleArray[a * 3 + 2];
-		for (int b = 0; b < 3; b++)
+		// Single step from the top (the walls of every land): both rings and the wall triangles are built in one pass
+		int nextVertexIndex = edges.Num() * 2;
+		FVector offset = FVector(0, 0, extrusion[1]);
+		for (int e = 0; e < edges.Num(); e++)
 		{
-			int i2 = triangleArray[a * 3 + b];
-			if (i1 < i2)
+			const FMeshEdge& edge = edges[e];
+			vertices[e * 2 + 0] = inputVertices[edge.v0];
+			vertices[e * 2 + 1] = inputVertices[edge.v1];
+			vertices[nextVertexIndex + e * 2 + 0] = inputVertices[edge.v0] + offset;
+			vertices[nextVertexIndex + e * 2 + 1] = inputVertices[edge.v1] + offset;
+
+			uvs[e * 2 + 0] = FVector2D(inputUV[edge.v0].X, 0);
+			uvs[e * 2 + 1] = FVector2D(inputUV[edge.v1].X, 0);
+			uvs[nextVertexIndex + e * 2 + 0] = FVector2D(inputUV[edge.v0].X, 1);
+			uvs[nextVertexIndex + e * 2 + 1] = FVector2D(inputUV[edge.v1].X, 1);
+
+			FVector tangent = edgeTangent(edge);
+			FVector normal = wallNormal(edge);
+			for (int k : { e * 2, e * 2 + 1, nextVertexIndex + e * 2, nextVertexIndex + e * 2 + 1 })
 			{
-				FEdgeData newEdge = FEdgeData();
-				newEdge.vertexIndex.X = i1;
-				newEdge.vertexIndex.Y = i2;
-				newEdge.faceIndex.X = a;
-				newEdge.faceIndex.Y = a;
-				edgeArray[edgeCount] = newEdge;
-
-				int edgeIndex = firstEdge[i1];
-				if (edgeIndex == -1)
-				{
-					firstEdge[i1] = edgeCount;
-				}
-				else
-				{
-					while (true)
-					{
-						int index = firstEdge[nextEdge + edgeIndex];
-						if (index == -1)
-						{
-							firstEdge[nextEdge + edgeIndex] = edgeCount;
-							break;
-						}
-
-						edgeIndex = index;
-					}
-				}
-
-				firstEdge[nextEdge + edgeCount] = -1;
-				edgeCount++;
+				normals[k] = normal;
+				tangents[k] = tangent;
 			}
 
-			i1 = i2;
+			int triIndex = e * 6;
+			triangles[triIndex + 0] = e * 2;
+			triangles[triIndex + 1] = nextVertexIndex + e * 2;
+			triangles[triIndex + 2] = e * 2 + 1;
+			triangles[triIndex + 3] = nextVertexIndex + e * 2;
+			triangles[triIndex + 4] = nextVertexIndex + e * 2 + 1;
+			triangles[triIndex + 5] = e * 2 + 1;
 		}
 	}
-
-	// Second pass over all triangles. This finds all the edges satisfying the
-	// condition that the first vertex index is greater than the second vertex index
-	// when the direction from the first vertex to the second vertex represents
-	// a counterclockwise winding around the triangle to which the edge belongs.
-	// For each of these edges, the same edge should have already been found in
-	// the first pass for a different triangle. Of course we might have edges with only one triangle
-	// in that case we just add the edge here
-	// So we search the list of edges
-	// for the higher-numbered vertex index for the matching edge and fill in the
-	// second triangle index. The maximum number of comparisons in this search for
-	// any vertex is the number of edges having that vertex as an endpoint.
-
-	for (int a = 0; a < triangleCount; a++)
+	else
 	{
-		int i1 = triangleArray[a * 3 + 2];
-		for (int b = 0; b < 3; b++)
+		// Build extruded vertices
+		int v = 0;
+		for (int i = 0; i < extrusion.Num(); i++)
 		{
-			int i2 = triangleArray[a * 3 + b];
-			if (i1 > i2)
+			float extrude = extrusion[i];
+			float vcoord = (float)i / (extrusion.Num() - 1);
+			for (const FMeshEdge& e : edges)
 			{
-				bool foundEdge = false;
-				for (int edgeIndex = firstEdge[i2]; edgeIndex != -1; edgeIndex = firstEdge[nextEdge + edgeIndex])
-				{
-					FEdgeData edge = edgeArray[edgeIndex];
-					if ((edge.vertexIndex.Y == i1) && (edge.faceIndex.X == edge.faceIndex.Y))
-					{
-						edgeArray[edgeIndex].faceIndex.Y = a;
-						foundEdge = true;
-						break;
-					}
-				}
-
-				if (!foundEdge)
-				{
-					FEdgeData newEdge = FEdgeData();
-					newEdge.vertexIndex.X = i1;
-					newEdge.vertexIndex.Y = i2;
-					newEdge.faceIndex.X = a;
-					newEdge.faceIndex.Y = a;
-					edgeArray[edgeCount] = newEdge;
-					edgeCount++;
-				}
-			}
-
-			i1 = i2;
-		}
-	}
-
-	TArray<FEdgeData> compactedEdges = TArray<FEdgeData>();
-	for (int e = 0; e < edgeCount; e++)
-		compactedEdges.Add(edgeArray[e]);
-
-
-	return compactedEdges;
-}
+				vertices[v + 0] = inputVertices[e.v0] - FVector(0, 0, -extrude);
+				vertices[v + 1] = inputVertices[e.v1] - FVector(0, 0, -extrude);
 
+				uvs[v + 0] = FVector2D(inputUV[e.v0].X, vcoord);
+				uvs[v + 1] = FVector2D(inputUV[e.v1].X, vcoord);
 
-// Disclaimer: major parts of the extrusion process where picked off stackoverflow
-// after hours of fighting faulty normal orientations.This is the case for the following function
-TArray<FEdgeData> AAMapGenerator::BuildManifoldEdge(ALand* mesh)
-{
-	TArray<FEdgeData> edges = AAMapGenerator::BuildEdge(mesh->verts.Num(), mesh->tris);
-	TArray<FEdgeData> culledEdges = TArray<FEdgeData>();
+				tangents[v + 0] = tangents[v + 1] = edgeTangent(e);
+				normals[v + 0] = normals[v + 1] = wallNormal(e);
 
-	//Only keep edges that are connected to	a single triangle
-	for(FEdgeData edge : edges)
-	{
-		if (edge.faceIndex.X == edge.faceIndex.Y)
-		{
-			culledEdges.Add(edge);
+				v += 2;
+			}
 		}
-	}
-	return culledEdges;
-}
-
-
-// Disclaimer: major parts of the extrusion process where picked off stackoverflow
-// after hours of fighting faulty normal orientations.This is the case for the following function
-ALand* AAMapGenerator::ExtrudeMesh(ALand* mesh, TArray<float> extrusion, TArray<FEdgeData> edges, bool invertFaces)
-{
-	int extrudedVertexCount = edges.Num() * 2 * extrusion.Num();
-	int triIndicesPerStep = edges.Num() * 6;
-	int extrudedTriIndexCount = triIndicesPerStep * (extrusion.Num() - 1);
 
-	TArray<FVector> inputVertices = mesh->verts;
-	TArray<FVector2D> inputUV = mesh->uvs;
-	TArray<int> inputTriangles = mesh->tris;
-
-	FVector* vertices = new FVector[extrudedVertexCount + inputVertices.Num() * 2];
-	FVector2D* uvs = new FVector2D[extrudedVertexCount + inputVertices.Num() * 2];
-	int* triangles = new int[extrudedTriIndexCount + inputTriangles.Num() * 2];
-
-	int vertCount = extrudedVertexCount + inputVertices.Num() * 2;
-	int triangleCount = extrudedTriIndexCount + inputTriangles.Num() * 2;
-
-	// Build extruded vertices
-	int v = 0;
-	for (int i = 0; i < extrusion.Num(); i++)
-	{
-		float extrude = extrusion[i];
-		float vcoord = (float)i / (extrusion.Num() - 1);
-		for(FEdgeData e : edges)
+		// Build extruded triangles
+		for (int i = 0; i < extrusion.Num() - 1; i++)
 		{
-			vertices[v + 0] = inputVertices[e.vertexIndex.X] - FVector(0, 0, -extrude);
-			vertices[v + 1] = inputVertices[e.vertexIndex.Y] - FVector(0, 0, -extrude);
-
-			uvs[v + 0] = FVector2D(inputUV[e.vertexIndex[0]].X, vcoord);
-			uvs[v + 1] = FVector2D(inputUV[e.vertexIndex[1]].X, vcoord);
-
-			v += 2;
+			int baseVertexIndex = (edges.Num() * 2) * i;
+			int nextVertexIndex = (edges.Num() * 2) * (i + 1);
+			for (int e = 0; e < edges.Num(); e++)
+			{
+				int triIndex = i * triIndicesPerStep + e * 6;
+
+				triangles[triIndex + 0] = baseVertexIndex + e * 2;
+				triangles[triIndex + 1] = nextVertexIndex + e * 2;
+				triangles[triIndex + 2] = baseVertexIndex + e * 2 + 1;
+				triangles[triIndex + 3] = nextVertexIndex + e * 2;
+				triangles[triIndex + 4] = nextVertexIndex + e * 2 + 1;
+				triangles[triIndex + 5] = baseVertexIndex + e * 2 + 1;
+			}
 		}
 	}
 
 	// Build cap vertices
 	// * The bottom mesh we scale along it's negative extrusion direction. This way extruding a half sphere results in a capsule.
-	for (int c = 0; c < 2; c++)
+	for (int c = 0; c < capCount; c++)
 	{
 		float extrude = extrusion[c == 0 ? 0 : extrusion.Num() - 1];
 		int firstCapVertex = c == 0 ? extrudedVertexCount : extrudedVertexCount + inputVertices.Num();
+
+		//the top faces up and the bottom down
+		FVector capNormal = (c == 0) != invertFaces ? FVector::UpVector : -FVector::UpVector;
 		for (int i = 0; i < inputVertices.Num(); i++)
 		{
 			vertices[firstCapVertex + i] = inputVertices[i] - FVector(0, 0, -extrude);
 			uvs[firstCapVertex + i] = inputUV[i];
-		}
-	}
-
-	// Build extruded triangles
-	for (int i = 0; i < extrusion.Num() - 1; i++)
-	{
-		int baseVertexIndex = (edges.Num() * 2) * i;
-		int nextVertexIndex = (edges.Num() * 2) * (i + 1);
-		for (int e = 0; e < edges.Num(); e++)
-		{
-			int triIndex = i * triIndicesPerStep + e * 6;
-
-			triangles[triIndex + 0] = baseVertexIndex + e * 2;
-			triangles[triIndex + 1] = nextVertexIndex + e * 2;
-			triangles[triIndex + 2] = baseVertexIndex + e * 2 + 1;
-			triangles[triIndex + 3] = nextVertexIndex + e * 2;
-			triangles[triIndex + 4] = nextVertexIndex + e * 2 + 1;
-			triangles[triIndex + 5] = baseVertexIndex + e * 2 + 1;
+			normals[firstCapVertex + i] = capNormal;
+			tangents[firstCapVertex + i] = FVector::ForwardVector;
 		}
 	}
 
@@ -802,6 +1989,7 @@ ALand* AAMapGenerator::ExtrudeMesh(ALand* mesh, TArray<float> extrusion, TArray<
 	}
 
 	// Bottom
+	if (bottomCap)
 	{
 		int firstCapVertex = extrudedVertexCount + inputVertices.Num();
 		int firstCapTriIndex = extrudedTriIndexCount + inputTriangles.Num();
@@ -816,113 +2004,107 @@ ALand* AAMapGenerator::ExtrudeMesh(ALand* mesh, TArray<float> extrusion, TArray<
 	if (invertFaces)
 	{
 		for (int i = 0; i < triangleCount / 3; i++)
-		{
-			int temp = triangles[i * 3 + 0];
-			triangles[i * 3 + 0] = triangles[i * 3 + 1];
-			triangles[i * 3 + 1] = temp;
-		}
+			Swap(triangles[i * 3 + 0], triangles[i * 3 + 1]);
 	}
 
 	//replace mesh data
-	mesh->verts = TArray<FVector>();
-	mesh->uvs = TArray<FVector2D>();
-	mesh->tris = TArray<int>();
-	for (int i = 0; i < vertCount; i++)
-	{
-		mesh->verts.Add(vertices[i]);
-		mesh->uvs.Add(uvs[i]);
-	}
-	for (int i = 0; i < triangleCount; i++) {
-		mesh->tris.Add(triangles[i]);
-	}
-
-	return mesh;
+	mesh.verts = MoveTemp(vertices);
+	mesh.uvs = MoveTemp(uvs);
+	mesh.normals = MoveTemp(normals);
+	mesh.tangents = MoveTemp(tangents);
+	mesh.tris = MoveTemp(triangles);
 }
 
 
-ALand* AAMapGenerator::PerformMeshExtrusion(ALand* mesh, TArray<float> extrusionHeight)
+void AAMapGenerator::PerformMeshExtrusion(FLandMeshData& mesh, const TArray<float>& extrusionHeight, const TArray<FMeshEdge>& edges)
 {
-	TArray<FEdgeData> edges = AAMapGenerator::BuildManifoldEdge(mesh);
-	//mesh = AAMapGenerator::SmoothEdge(mesh, edges);
-	mesh = AAMapGenerator::StoreEdge(mesh, edges);
-	mesh = AAMapGenerator::ExtrudeMesh(mesh, extrusionHeight, edges, false);
-	mesh = AAMapGenerator::RemoveDuplicateVertices(mesh);
-	
-
-	return mesh;
+	//AAMapGenerator::SmoothEdge(mesh, edges);
+	AAMapGenerator::StoreEdge(mesh, edges);
+	AAMapGenerator::ExtrudeMesh(mesh, extrusionHeight, edges, false, !params.visibleSurfaceOnly);
 }
 
 
-ALand* AAMapGenerator::RemoveDuplicateVertices(ALand* mesh)
+// Welds the vertices which are closer than weldTolerance and share the same normal, keeping the first vertex of each group.
+// Vertices are hashed in a grid of weldTolerance wide cells so only the 27 cells around a vertex are searched,
+// and the triangles are remapped once at the end. The tops and walls meet at a hard edge, so they are never welded together
+void AAMapGenerator::RemoveDuplicateVertices(FLandMeshData& mesh)
 {
-	TArray<FVector> verts = mesh->verts;
-	TArray<FVector2D> uvs = mesh->uvs;
-	TArray<int> tris = mesh->tris;
+	float tolerance = FMath::Max(params.weldTolerance, KINDA_SMALL_NUMBER);
+	int n = mesh.verts.Num();
 
-	float duplicateDist = 0.1f;
+	//welded vertices are compacted in place, the grid stores their new index
+	TMultiMap<FIntVector, int32> grid = TMultiMap<FIntVector, int32>();
+	grid.Reserve(n);
+	TArray<int32> remap = TArray<int32>();
+	remap.SetNumUninitialized(n);
 
-	int i = 0;
-	while (i < verts.Num())
+	int vertCount = 0;
+	for (int i = 0; i < n; i++)
 	{
-		int j = i + 1;
-		while (j < verts.Num())
+		FVector vert = mesh.verts[i];
+		FIntVector cell = FIntVector(FMath::FloorToInt(vert.X / tolerance), FMath::FloorToInt(vert.Y / tolerance), FMath::FloorToInt(vert.Z / tolerance));
+
+		int32 weldedTo = INDEX_NONE;
+		for (int dx = -1; dx <= 1 && weldedTo == INDEX_NONE; dx++)
 		{
-			//if vertices j and i are close enough, merge them
-			float dist = (verts[i] - verts[j]).Size();
-			if (dist < duplicateDist)
+			for (int dy = -1; dy <= 1 && weldedTo == INDEX_NONE; dy++)
 			{
-				//asssign tris to vertex i instead of j and every vert that is larger than j ar shifted one index down to match the removal of a vert
-				for (int k = 0; k < tris.Num(); k++)
+				for (int dz = -1; dz <= 1 && weldedTo == INDEX_NONE; dz++)
 				{
-					if (tris[k] == j)
-						tris[k] = i;
-					else if (tris[k] > j)
-						tris[k]--;
+					for (TMultiMap<FIntVector, int32>::TConstKeyIterator it = grid.CreateConstKeyIterator(cell + FIntVector(dx, dy, dz)); it; ++it)
+					{
+						if ((mesh.verts[it.Value()] - vert).Size() < tolerance && (mesh.normals[it.Value()] | mesh.normals[i]) > weldNormalThreshold)
+						{
+							weldedTo = it.Value();
+							break;
+						}
+					}
 				}
-
-				//remove index at j-th position
-				verts.RemoveAt(j);
-				uvs.RemoveAt(j);
 			}
-			else
-				j++;
 		}
-		i++;
+
+		//no vertex close enough, keep this one
+		if (weldedTo == INDEX_NONE)
+		{
+			mesh.verts[vertCount] = vert;
+			mesh.uvs[vertCount] = mesh.uvs[i];
+			mesh.normals[vertCount] = mesh.normals[i];
+			mesh.tangents[vertCount] = mesh.tangents[i];
+			grid.Add(cell, vertCount);
+			weldedTo = vertCount++;
+		}
+
+		remap[i] = weldedTo;
 	}
 
-	mesh->verts = verts;
-	mesh->tris = tris;
-	mesh->uvs = uvs;
-	return mesh;
+	mesh.verts.SetNum(vertCount, false);
+	mesh.uvs.SetNum(vertCount, false);
+	mesh.normals.SetNum(vertCount, false);
+	mesh.tangents.SetNum(vertCount, false);
+	for (int& idx : mesh.tris)
+		idx = remap[idx];
 }
 
 
-ALand* AAMapGenerator::SmoothEdge(ALand* mesh, TArray<FEdgeData> edges)
+void AAMapGenerator::SmoothEdge(FLandMeshData& mesh, const TArray<FMeshEdge>& edges)
 {
-	TArray<FVector> smoothedVerts = mesh->verts;
+	//each vertex is averaged with itself and its neighbours along the edges, accumulated in a single pass over the edges
+	TArray<FVector> smoothedVerts = mesh.verts;
+	TArray<int> counts = TArray<int>();
+	counts.Init(1, mesh.verts.Num());
 
-	for (int i = 0; i < smoothedVerts.Num(); i++)
+	for (const FMeshEdge& e : edges)
 	{
-		int count = 1;
-		for(FEdgeData e : edges)
-		{
-			if (e.vertexIndex[0] == i)
-			{
-				smoothedVerts[i] += mesh->verts[e.vertexIndex[1]];
-				count++;
-			}
-			else if (e.vertexIndex[1] == i)
-			{
-				smoothedVerts[i] += mesh->verts[e.vertexIndex[0]];
-				count++;
-			}
-		}
-
-		smoothedVerts[i] /= (float)count;
+		smoothedVerts[e.v0] += mesh.verts[e.v1];
+		smoothedVerts[e.v1] += mesh.verts[e.v0];
+		counts[e.v0]++;
+		counts[e.v1]++;
 	}
 
-	mesh->verts = smoothedVerts;
-	return mesh;
+	for (int i = 0; i < smoothedVerts.Num(); i++)
+		smoothedVerts[i] /= (float)counts[i];
+
+	mesh.verts = smoothedVerts;
 }
 
 
@@ -933,12 +2115,18 @@ void AAMapGenerator::GenerateClouds()
 
 	if (cloudMeshes.Num() > 0) {
 
+		//each cloud draws from its own key of the clouds stream
+		CounterRandom random(params.seed, ERandomStage::Clouds);
+
+		cloudsDistribution.Reset();
+		cloudsPosition.Reset();
+
 		//Pick a number cloud in cloudAmount +/- 50%
-		int cloudNumber = (rand() % cloudAmount) + (cloudAmount / 2);
+		int cloudNumber = random.RandRange(0, cloudAmount - 1, -1) + (cloudAmount / 2);
 
 		for (int i = 0; i < cloudNumber; i++) {
-			cloudsDistribution.Add(cloudMeshes[rand() % cloudMeshes.Num()]);
-			cloudsPosition.Add(FVector(rand() % mapSize - (float)mapSize /2.0, rand() % mapSize - (float)mapSize / 2.0, (mapLevels + 10) * heightScale + rand() % 2));
+			cloudsDistribution.Add(cloudMeshes[random.RandRange(0, cloudMeshes.Num() - 1, i, 0)]);
+			cloudsPosition.Add(FVector(random.RandRange(0, params.mapSize - 1, i, 1) - (float)params.mapSize /2.0, random.RandRange(0, params.mapSize - 1, i, 2) - (float)params.mapSize / 2.0, (params.mapLevels + 10) * params.heightScale + random.RandRange(0, 1, i, 3)));
 		}
 	}
 
@@ -1146,26 +2334,27 @@ bool AAMapGenerator::IsInner(TArray<int> isInsideContour, int idx)
 
 void AAMapGenerator::PickLandmarks()
 {
-	//prepare spawn offset
-	float leftCorner = ((float)mapSize - 1.0f) / 2.0f;
-	float topCorner = ((float)mapSize - 1.0f) / 2.0f;
-
+	TArray<FLandmarkPlacement>& placements = generationState.landmarkPlacements;
+	placements.Reset();
 
 	//create a buffer of potential landmarks
-	TArray<TSubclassOf<ALandmark>> buffer = potentialLandmarks;
+	TArray<TSubclassOf<ALandmark>> buffer = params.potentialLandmarks;
+	int landmarkCount = FMath::Min(params.amountOfLandmarks, params.potentialLandmarks.Num());
 
-	if (amountOfLandmarks > potentialLandmarks.Num())
-		amountOfLandmarks = potentialLandmarks.Num();
+	//landmark i draws its class from key (i) and its location attempts from keys (i, attempt)
+	CounterRandom random(params.seed, ERandomStage::Landmarks);
 
 	//pick required amount of landmarks 
-	for (int i = 0; i < amountOfLandmarks; i++)
+	for (int i = 0; i < landmarkCount; i++)
 	{
-		//choose a random landmark
-		int idx = FMath::RandRange(0, buffer.Num() - 1);
-		UClass* selectedClass = *buffer[idx];
-
-		//spawn landmark
-		ALandmark* newLandmark = Cast<ALandmark>(GetWorld()->SpawnActor(selectedClass));
+		//choose a random landmark, its size is read from the defaults of its class
+		int idx = random.RandRange(0, buffer.Num() - 1, i);
+		const ALandmark* defaults = buffer[idx]->GetDefaultObject<ALandmark>();
+
+		FLandmarkPlacement newLandmark;
+		newLandmark.landmarkClass = buffer[idx];
+		newLandmark.radius = defaults->radius;
+		newLandmark.baseHeight = defaults->baseHeight;
 		int X = 0;
 		int Y = 0;
 
@@ -1182,137 +2371,213 @@ void AAMapGenerator::PickLandmarks()
 				break;
 
 			//random location
-			X = FMath::RandRange(newLandmark->radius, mapSize - newLandmark->radius);
-			Y = FMath::RandRange(newLandmark->radius, mapSize - newLandmark->radius);
+			X = random.RandRange(newLandmark.radius, params.mapSize - newLandmark.radius, i, ittNb, 0);
+			Y = random.RandRange(newLandmark.radius, params.mapSize - newLandmark.radius, i, ittNb, 1);
 
 			tooClose = false;
-			for (int j = 0; j < landmarks.Num(); j++) {
+			for (int j = 0; j < placements.Num(); j++) {
 				//distance to other landmark
-				float dist = sqrt((X - landmarks[j]->mapPosition.X) * (X - landmarks[j]->mapPosition.X)
-					+ (Y - landmarks[j]->mapPosition.Y) * (Y - landmarks[j]->mapPosition.Y));
+				float dist = sqrt((X - placements[j].mapPosition.X) * (X - placements[j].mapPosition.X)
+					+ (Y - placements[j].mapPosition.Y) * (Y - placements[j].mapPosition.Y));
 				//compare to sum of radii (and thetwice the amount of levels to make sure falloffs won't interfere)
-				if (dist < newLandmark->radius + landmarks[j]->radius /*+ 2 * mapLevels*/) {
+				if (dist < newLandmark.radius + placements[j].radius /*+ 2 * mapLevels*/) {
 					tooClose = true;
 					break;
 				}
 			}
 		}
 		if (ittNb > maxIttNum) 
-		{
-			newLandmark->Destroy();
 			return;
-		}
-		else
-		{
-			//store location
-			newLandmark->mapPosition = FVector2D(X, Y);
 
-			//set world location and location
-			newLandmark->SetActorLocation(FVector((Y - leftCorner) * globalScale, (X - topCorner) * globalScale, ((int)(newLandmark->baseHeight * (mapLevels - 1))) * heightScale * globalScale));
-			//newLandmark->SetActorRotation(FRotator(0, 0, FMath::RandRange(0, 360)));
+		//store location
+		newLandmark.mapPosition = FVector2D(X, Y);
+		placements.Add(newLandmark);
 
-			//store new landmark
-			landmarks.Add(newLandmark);
+		//remove idx from buffer to avoid spawning again
+		buffer.RemoveAt(idx);
+	}
+}
 
-			//remove idx from buffer to avoid spawning again
-			buffer.RemoveAt(idx);
-		}
+
+// Spawns the landmarks picked by PickLandmarks
+void AAMapGenerator::SpawnLandmarks()
+{
+	//prepare spawn offset
+	float leftCorner = ((float)params.mapSize - 1.0f) / 2.0f;
+	float topCorner = ((float)params.mapSize - 1.0f) / 2.0f;
+
+	for (const FLandmarkPlacement& placement : generationState.landmarkPlacements)
+	{
+		ALandmark* newLandmark = generationState.AcquireLandmark(GetWorld(), placement.landmarkClass);
+		int X = placement.mapPosition.X;
+		int Y = placement.mapPosition.Y;
+		newLandmark->mapPosition = placement.mapPosition;
+
+		//set world location and location
+		newLandmark->SetActorLocation(FVector((Y - leftCorner) * params.globalScale, (X - topCorner) * params.globalScale, ((int)(placement.baseHeight * (params.mapLevels - 1))) * params.heightScale * params.globalScale));
+		//newLandmark->SetActorRotation(FRotator(0, 0, FMath::RandRange(0, 360)));
+
+		landmarks.Add(newLandmark);
 	}
 }
 
 
+// Flattens the ground under the landmarks and spreads the flattening so that no step around them is higher than one level
 void AAMapGenerator::MatchLandToLandmarks()
 {
-	TArray<FVector2D> lastAddedPoints = TArray<FVector2D>();
-	int* mapMask = new int[mapSize * mapSize];
+	AAMapGenerator::BeginLandmarkFlattening();
 
-	//For each landmark, level ground to base landmark level
-	for (ALandmark* landmark : landmarks) 
-	{
-		for (int i = 0; i < mapSize; i++)
-		{
-			for (int j = 0; j < mapSize; j++)
-			{
-				//compute distance to landmark center
-				float dist = sqrt((i - landmark->mapPosition.X) * (i - landmark->mapPosition.X)
-					+ (j - landmark->mapPosition.Y) * (j - landmark->mapPosition.Y));
+	for (const FLandmarkPlacement& landmark : generationState.landmarkPlacements)
+		AAMapGenerator::FlattenLandmark(landmark);
 
-				if (dist < landmark->radius) {
-					noiseMap[i * mapSize + j] = landmark->baseHeight;
+	while (AAMapGenerator::SpreadLandmarkFlattening());
+	AAMapGenerator::UpdateReshapedGradient();
+}
 
-					//update the mask and store as outter ring points
-					mapMask[i * mapSize + j] = 1;
-					lastAddedPoints.Add(FVector2D(i, j));
-				}
+
+void AAMapGenerator::BeginLandmarkFlattening()
+{
+	generationState.landmarkMask.Init(false, params.mapSize * params.mapSize);
+	generationState.landmarkFrontier.Reset();
+	generationState.landmarkReshaped.Reset();
+}
+
+
+// Levels the ground under a landmark to its base level
+void AAMapGenerator::FlattenLandmark(const FLandmarkPlacement& landmark)
+{
+	TBitArray<>& mapMask = generationState.landmarkMask;
+
+	//only the pixels around the landmark can be within its radius
+	int firstRow = FMath::Max(0, FMath::FloorToInt(landmark.mapPosition.X - landmark.radius));
+	int lastRow = FMath::Min(params.mapSize - 1, FMath::CeilToInt(landmark.mapPosition.X + landmark.radius));
+	int firstColumn = FMath::Max(0, FMath::FloorToInt(landmark.mapPosition.Y - landmark.radius));
+	int lastColumn = FMath::Min(params.mapSize - 1, FMath::CeilToInt(landmark.mapPosition.Y + landmark.radius));
+	for (int i = firstRow; i <= lastRow; i++)
+	{
+		for (int j = firstColumn; j <= lastColumn; j++)
+		{
+			//compute distance to landmark center
+			float dist = sqrt((i - landmark.mapPosition.X) * (i - landmark.mapPosition.X)
+				+ (j - landmark.mapPosition.Y) * (j - landmark.mapPosition.Y));
+
+			if (dist < landmark.radius) {
+				generationState.noiseMap[i * params.mapSize + j] = landmark.baseHeight;
+				if (generationState.noiseGradient.Num() > 0)
+					generationState.noiseGradient[i * params.mapSize + j] = FVector2D(0, 0);
+
+				//update the mask and store as outter ring points
+				mapMask[i * params.mapSize + j] = true;
+				generationState.landmarkFrontier.Add(FVector2D(i, j));
 			}
 		}
 	}
+}
+
+
+// Spreads the flattening by one ring of pixels. Returns false once there is no new outter point
+bool AAMapGenerator::SpreadLandmarkFlattening()
+{
+	TArray<FVector2D>& lastAddedPoints = generationState.landmarkFrontier;
+	if (lastAddedPoints.Num() == 0)
+		return false;
 
-	//propagate flattening (itterate until there is no new outter points
-	while (lastAddedPoints.Num() > 0)
+	TBitArray<>& mapMask = generationState.landmarkMask;
+	TArray<FVector2D> buffer = TArray<FVector2D>();
+	//for each outter points
+	for (FVector2D outterPoint : lastAddedPoints)
 	{
-		TArray<FVector2D> buffer = TArray<FVector2D>();
-		//for each outter points
-		for (FVector2D outterPoint : lastAddedPoints)
+		//check all 8 points around it
+		for (int i = -1; i <= 1; i++) 
 		{
-			//check all 8 points around it
-			for (int i = -1; i <= 1; i++) 
+			for (int j = -1; j <= 1; j++)
 			{
-				for (int j = -1; j <= 1; j++)
+				if (j != 0 || i != 0)
 				{
-					if (j != 0 || i != 0)
+					//if within map bounds
+					if ((i + (int)outterPoint.X) < params.mapSize && (i + (int)outterPoint.X) >= 0
+						&& (j + (int)outterPoint.Y) < params.mapSize && (j + (int)outterPoint.Y >= 0)) 
 					{
-						//if within map bounds
-						if ((i + (int)outterPoint.X) < mapSize && (i + (int)outterPoint.X) >= 0
-							&& (j + (int)outterPoint.Y) < mapSize && (j + (int)outterPoint.Y >= 0)) 
+						//if not yet tested
+						if (!mapMask[(i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y)]) 
 						{
-							//if not yet tested
-							if (mapMask[(i + (int)outterPoint.X) * mapSize + (j + (int)outterPoint.Y)] != 1) 
+							//set as tested
+							mapMask[(i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y)] = true;
+
+							//register as edge point and flatten
+							buffer.Add(FVector2D(i + outterPoint.X, j + outterPoint.Y));
+
+							//check height difference. The heights of the previous ring were just changed by the flattening,
+							//so they are read back from the noise map rather than from the gradient of the original noise
+							float heightDifference = generationState.noiseMap[(i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y)]
+								- generationState.noiseMap[(int)outterPoint.X * params.mapSize + (int)outterPoint.Y];
+
+							//check wheter the height difference is greater than one level
+							if (abs(heightDifference) > 1.0 / (float)(params.mapLevels - 1))
 							{
-								//set as tested
-								mapMask[(i + (int)outterPoint.X) * mapSize + (j + (int)outterPoint.Y)] = 1;
-
-								//register as edge point and flatten
-								buffer.Add(FVector2D(i + outterPoint.X, j + outterPoint.Y));
-
-								//check height difference
-								float heightDifference = noiseMap[(i + (int)outterPoint.X) * mapSize + (j + (int)outterPoint.Y)]
-									- noiseMap[(int)outterPoint.X * mapSize + (int)outterPoint.Y];
-
-								//check wheter the height difference is greater than one level
-								if (abs(heightDifference) > 1.0 / (float)(mapLevels - 1))
-								{
-									//check slope direction
-									float sign = 1;
-									if (heightDifference < 0)
-										sign = -1;
-
-									//assign new height
-									noiseMap[(i + (int)outterPoint.X) * mapSize + (j + (int)outterPoint.Y)] 
-										= noiseMap[(int)outterPoint.X * mapSize + (int)outterPoint.Y] 
-										+ sign / (float)(mapLevels - 1);
-
-									//clamp
-									if (noiseMap[(i + (int)outterPoint.X) * mapSize + (j + (int)outterPoint.Y)] >= 1)
-										noiseMap[(i + (int)outterPoint.X) * mapSize + (j + (int)outterPoint.Y)] = .99;
-									else if (noiseMap[(i + (int)outterPoint.X) * mapSize + (j + (int)outterPoint.Y)] < 0)
-										noiseMap[(i + (int)outterPoint.X) * mapSize + (j + (int)outterPoint.Y)] = 0;
-								}
+								//check slope direction
+								float sign = 1;
+								if (heightDifference < 0)
+									sign = -1;
+
+								//assign new height, its analytic gradient does not hold anymore
+								generationState.landmarkReshaped.Add((i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y));
+								generationState.noiseMap[(i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y)] 
+									= generationState.noiseMap[(int)outterPoint.X * params.mapSize + (int)outterPoint.Y] 
+									+ sign / (float)(params.mapLevels - 1);
+
+								//clamp
+								if (generationState.noiseMap[(i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y)] >= 1)
+									generationState.noiseMap[(i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y)] = .99;
+								else if (generationState.noiseMap[(i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y)] < 0)
+									generationState.noiseMap[(i + (int)outterPoint.X) * params.mapSize + (j + (int)outterPoint.Y)] = 0;
 							}
 						}
 					}
 				}
 			}
 		}
-		lastAddedPoints = buffer;
 	}
+	lastAddedPoints = MoveTemp(buffer);
+	return lastAddedPoints.Num() > 0;
+}
+
+
+// The pixels raised or lowered by the spread no longer follow the noise function, so their gradient is estimated
+// from their neighbours (central differences, one sided on the map border). It is done once the spread is over
+// as the neighbours of a pixel may be reshaped by the next rings
+void AAMapGenerator::UpdateReshapedGradient()
+{
+	if (generationState.noiseGradient.Num() == params.mapSize * params.mapSize)
+	{
+		const TArray<float>& noiseMap = generationState.noiseMap;
+		for (int32 pixel : generationState.landmarkReshaped)
+		{
+			int i = pixel / params.mapSize;
+			int j = pixel % params.mapSize;
+			int left = FMath::Max(j - 1, 0);
+			int right = FMath::Min(j + 1, params.mapSize - 1);
+			int up = FMath::Max(i - 1, 0);
+			int down = FMath::Min(i + 1, params.mapSize - 1);
+
+			generationState.noiseGradient[pixel] = FVector2D(
+				(noiseMap[i * params.mapSize + right] - noiseMap[i * params.mapSize + left]) / (right - left),
+				(noiseMap[down * params.mapSize + j] - noiseMap[up * params.mapSize + j]) / (down - up));
+		}
+	}
+	generationState.landmarkReshaped.Reset();
 }
 
 void AAMapGenerator::GenerateRockAndTrees()
 {
-	for (int i = 0; i < mapSize - 1; i++)
+	spawnedProps.Reset();
+
+	//each cell draws its prop from its own key so that cells can be processed in any order
+	CounterRandom random(params.seed, ERandomStage::Props);
+
+	for (int i = 0; i < params.mapSize - 1; i++)
 	{
-		for (int j = 0; j < mapSize - 1; j++)
+		for (int j = 0; j < params.mapSize - 1; j++)
 		{
 			float x = i + 0.5;
 			float y = j + 0.5;
@@ -1329,32 +2594,48 @@ void AAMapGenerator::GenerateRockAndTrees()
 				}
 			}
 			
+			//when the gradient channel is available, steep cells are read directly from it
+			if (canSpawn && maxPropSlope > 0 && generationState.noiseGradient.Num() == params.mapSize * params.mapSize)
+			{
+				if (generationState.noiseGradient[i * params.mapSize + j].Size() * (params.mapLevels - 1) > maxPropSlope)
+					canSpawn = false;
+			}
+
 			if (canSpawn)
 			{
 				//int itt = 0;
-				//while (floor(inGameBioms[itt]->biomSeparation * (mapLevels - 1)) < floor(noiseMap[i * mapSize + j] * (mapLevels - 1)))
+				//while (floor(inGameBioms[itt]->biomSeparation * (mapLevels - 1)) < generationState.levelMap[i * mapSize + j])
 				//{
 				//	itt++;
 				//	if (itt >= inGameBioms.Num())
 				//		break;
 				//}
 
-				if (floor(noiseMap[i * mapSize + j] * (mapLevels - 1)) == floor(noiseMap[(i + 1) * mapSize + j] * (mapLevels - 1))
-					&& floor(noiseMap[(i + 1) * mapSize + j] * (mapLevels - 1)) == floor(noiseMap[i * mapSize + (j + 1)] * (mapLevels - 1))
-					&& floor(noiseMap[(i + 1) * mapSize + j] * (mapLevels - 1)) == floor(noiseMap[(i + 1) * mapSize + (j + 1)] * (mapLevels - 1)))
+				//this is not a slope test, it checks the cell is on the top of a single terrace. The gradient can't
+				//answer it: a gentle slope still crosses a terrace edge, and a steep one may stay within a level
+				int level = generationState.levelMap[i * params.mapSize + j];
+				if (level == generationState.levelMap[(i + 1) * params.mapSize + j]
+					&& level == generationState.levelMap[i * params.mapSize + (j + 1)]
+					&& level == generationState.levelMap[(i + 1) * params.mapSize + (j + 1)])
 				{
-					FVector position = FVector(y - ((float)(mapSize - 1) / 2.0), x - ((float)(mapSize - 1) / 2.0), floor(noiseMap[i * mapSize + j] * (mapLevels - 1) + 5) * heightScale) * globalScale;
+					FVector position = FVector(y + meshOffset.X, x + meshOffset.Y, (level + 5) * params.heightScale) * params.globalScale;
 
 					//get the class of the new ressource
-					UClass* newPropClass = meshes[(int)(noiseMap[i * mapSize + j] * (mapLevels - 1))]->biom->GetRandomProp();
+					UClass* newPropClass = AAMapGenerator::GetLevelBiom(level)->GetRandomProp(random.FRand(i + noiseOffset.Y, j + noiseOffset.X));
 
-					//if there is actually a ressource to spawn, spawn it
+					//if there is actually a ressource to spawn, spawn it.
+					//XY coordinate is set at spawn. Z is chosen to hover over the final destination
 					if (newPropClass)
 					{
-						AProp* newPropActor = Cast<AProp>(GetWorld()->SpawnActor(newPropClass));
+						FTransform transform = FTransform(position);
+						AProp* newPropActor = GetWorld()->SpawnActorDeferred<AProp>(newPropClass, transform);
+						if (!newPropActor)
+							continue;
+						newPropActor->FinishSpawning(transform);
+						spawnedProps.Add(newPropActor);
 
-						//set XY coordinate. Z is chosen to hover over the final destination
-						newPropActor->SetActorLocation(position);
+						//the rock and tree meshes of the prop pick their mesh from the generation seed and the cell
+						AAMapGenerator::InitPropMeshes(newPropActor, FIntPoint(i + noiseOffset.Y, j + noiseOffset.X));
 
 						//newPropActor->propMeshComponent->SetStaticMesh(newProp);
 						newPropActor->MoveToClosestSurface();
@@ -1366,8 +2647,29 @@ void AAMapGenerator::GenerateRockAndTrees()
 }
 
 
+// Passes the generation seed and the map cell of a prop to the rock and tree meshes it is made of
+void AAMapGenerator::InitPropMeshes(AActor* prop, FIntPoint cell)
+{
+	TArray<AActor*> actors = TArray<AActor*>();
+	prop->GetAllChildActors(actors);
+	actors.Add(prop);
+
+	for (AActor* actor : actors)
+	{
+		if (ARockMesh* rock = Cast<ARockMesh>(actor))
+			rock->InitMesh(params.seed, cell);
+		else if (ATreeMesh* tree = Cast<ATreeMesh>(actor))
+			tree->InitMesh(params.seed, cell);
+	}
+}
+
+
 void AAMapGenerator::InitBioms()
 {
+	//bioms only depend on their classes, so they are spawned once and kept across generations
+	if (inGameBioms.Num() > 0)
+		return;
+
 	for (UClass* biom : bioms)
 	{
 		//spawn biom
@@ -1395,16 +2697,16 @@ void AAMapGenerator::InitBioms()
 
 uint8* AAMapGenerator::Smooth2DMap(uint8* Data)
 {
-	uint8* smoothedData = new uint8[mapSize * mapSize * 4];
+	uint8* smoothedData = new uint8[params.mapSize * params.mapSize * 4];
 
-	for(int i = 0; i < mapSize; i++)
+	for(int i = 0; i < params.mapSize; i++)
 	{
-		for (int j = 0; j < mapSize; j++)
+		for (int j = 0; j < params.mapSize; j++)
 		{
-			if (i == 0 || i == mapSize - 1 || j == 0 || j == mapSize - 1)
+			if (i == 0 || i == params.mapSize - 1 || j == 0 || j == params.mapSize - 1)
 			{
 				for (int k = 0; k < 3; k++)
-					smoothedData[(i * mapSize + j) * 4 + k] = Data[(i * mapSize + j) * 4 + 4];
+					smoothedData[(i * params.mapSize + j) * 4 + k] = Data[(i * params.mapSize + j) * 4 + 4];
 			}
 			else
 			{
@@ -1415,15 +2717,15 @@ uint8* AAMapGenerator::Smooth2DMap(uint8* Data)
 					{
 						for (int j1 = -1; j1 < 2; j1++)
 						{
-							s += Data[((i + i1) * mapSize + (j + j1)) * 4 + k];
+							s += Data[((i + i1) * params.mapSize + (j + j1)) * 4 + k];
 						}
 					}
 
 					s /= 9;
 
-					smoothedData[(i * mapSize + j) * 4 + k] = s;
+					smoothedData[(i * params.mapSize + j) * 4 + k] = s;
 				}
-				smoothedData[(i * mapSize + j) * 4 + 3] = 255;
+				smoothedData[(i * params.mapSize + j) * 4 + 3] = 255;
 			}
 		}
 	}
@@ -1434,11 +2736,11 @@ uint8* AAMapGenerator::Smooth2DMap(uint8* Data)
 
 uint8* AAMapGenerator::Contour2DMap(uint8* Data)
 {
-	uint8* smoothedData = new uint8[mapSize * mapSize * 4];
+	uint8* smoothedData = new uint8[params.mapSize * params.mapSize * 4];
 
-	for (int i = 0; i < mapSize; i++)
+	for (int i = 0; i < params.mapSize; i++)
 	{
-		for (int j = 0; j < mapSize; j++)
+		for (int j = 0; j < params.mapSize; j++)
 		{
 				//if not the same color as adjacent pixels, flag as contour 
 				bool contour = false;
@@ -1446,12 +2748,12 @@ uint8* AAMapGenerator::Contour2DMap(uint8* Data)
 				{
 					for (int j1 = -1; j1 < 2; j1++)
 					{
-						if (i + i1 >= 0 && i + i1 <= mapSize - 1 && j + j1 >= 0 && j + j1 <= mapSize - 1)
+						if (i + i1 >= 0 && i + i1 <= params.mapSize - 1 && j + j1 >= 0 && j + j1 <= params.mapSize - 1)
 						{
 
-							if (Data[((i + i1) * mapSize + (j + j1)) * 4 + 1] != Data[(i * mapSize + j) * 4 + 1]
-								|| Data[((i + i1) * mapSize + (j + j1)) * 4 + 2] != Data[(i * mapSize + j) * 4 + 2]
-								|| Data[((i + i1) * mapSize + (j + j1)) * 4 + 0] != Data[(i * mapSize + j) * 4 + 0])
+							if (Data[((i + i1) * params.mapSize + (j + j1)) * 4 + 1] != Data[(i * params.mapSize + j) * 4 + 1]
+								|| Data[((i + i1) * params.mapSize + (j + j1)) * 4 + 2] != Data[(i * params.mapSize + j) * 4 + 2]
+								|| Data[((i + i1) * params.mapSize + (j + j1)) * 4 + 0] != Data[(i * params.mapSize + j) * 4 + 0])
 							{
 								contour = true;
 								break;
@@ -1465,22 +2767,22 @@ uint8* AAMapGenerator::Contour2DMap(uint8* Data)
 				
 				if (contour)
 				{
-					smoothedData[(i * mapSize + j) * 4 + 0] = (uint8)(contourColor.B  * 255);
-					smoothedData[(i * mapSize + j) * 4 + 1] = (uint8)(contourColor.G * 255);
-					smoothedData[(i * mapSize + j) * 4 + 2] = (uint8)(contourColor.R * 255);
-					smoothedData[(i * mapSize + j) * 4 + 3] = (uint8)255;
+					smoothedData[(i * params.mapSize + j) * 4 + 0] = (uint8)(contourColor.B  * 255);
+					smoothedData[(i * params.mapSize + j) * 4 + 1] = (uint8)(contourColor.G * 255);
+					smoothedData[(i * params.mapSize + j) * 4 + 2] = (uint8)(contourColor.R * 255);
+					smoothedData[(i * params.mapSize + j) * 4 + 3] = (uint8)255;
 				}
 				else
 				{
 					for (int k = 0; k < 4; k++)
 					{
 						if (overlayContour)
-							smoothedData[(i * mapSize + j) * 4 + k] = Data[(i * mapSize + j) * 4 + k];
+							smoothedData[(i * params.mapSize + j) * 4 + k] = Data[(i * params.mapSize + j) * 4 + k];
 						else
-							smoothedData[(i * mapSize + j) * 4 + k] = 255;
+							smoothedData[(i * params.mapSize + j) * 4 + k] = 255;
 					}
 				}
-				smoothedData[(i * mapSize + j) * 4 + 3] = 255;
+				smoothedData[(i * params.mapSize + j) * 4 + 3] = 255;
 			
 		}
 	}
@@ -1549,12 +2851,196 @@ uint8* AAMapGenerator::ResampleMap(uint8* Data, int originalRes, int newRes)
 void AAMapGenerator::BeginPlay()
 {
 	Super::BeginPlay();
-	
-	AAMapGenerator::GenerateNoise();
+
+	if (streamChunks)
+	{
+		//chunks are generated on the fly around the player, so everything they share is set up once here
+		if (randomSeed)
+			seed = rand();
+		InitBioms();
+		SetActorTickEnabled(true);
+	}
+
+	//the queries on the map (water height...) read the parameters of the last generation, start from the properties
+	AAMapGenerator::SnapshotParameters();
+}
+
+void AAMapGenerator::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	//the background task works on the generation state, so it has to be done before the generator goes away
+	if (generationTask.IsValid())
+		generationTask.Wait();
+
+	Super::EndPlay(EndPlayReason);
 }
 
 // Called every frame
 void AAMapGenerator::Tick(float DeltaTime)
 {
 	Super::Tick(DeltaTime);
+
+	if (slicedGeneration.running)
+	{
+		//at least one unit of work is done each frame so that the generation always moves on
+		double endTime = FPlatformTime::Seconds() + generationFrameBudget / 1000.0;
+		while (!AAMapGenerator::StepSlicedGeneration() && FPlatformTime::Seconds() < endTime);
+	}
+
+	if (streamChunks)
+		AAMapGenerator::UpdateChunks();
+}
+
+
+// Generates the missing chunks around the player (closest first) and evicts the ones which went out of range
+void AAMapGenerator::UpdateChunks()
+{
+	APawn* player = UGameplayStatics::GetPlayerPawn(this, 0);
+	if (!player || params.mapSize < 2)
+		return;
+
+	//chunks share their border pixels so that the meshes line up
+	int chunkStride = params.mapSize - 1;
+	FVector location = player->GetActorLocation() / params.globalScale;
+	FIntPoint center = FIntPoint(FMath::FloorToInt(location.X / chunkStride), FMath::FloorToInt(location.Y / chunkStride));
+
+	//evict with one chunk of margin to avoid regenerating chunks when walking back and forth on a border
+	TArray<FIntPoint> outOfRange = TArray<FIntPoint>();
+	for (const TPair<FIntPoint, FTerrainChunk>& chunk : chunks)
+	{
+		FIntPoint delta = chunk.Key - center;
+		if (FMath::Max(FMath::Abs(delta.X), FMath::Abs(delta.Y)) > chunkViewRadius + 1)
+			outOfRange.Add(chunk.Key);
+	}
+	for (FIntPoint chunk : outOfRange)
+		AAMapGenerator::EvictChunk(chunk);
+
+	TArray<FIntPoint> missing = TArray<FIntPoint>();
+	for (int x = -chunkViewRadius; x <= chunkViewRadius; x++)
+	{
+		for (int y = -chunkViewRadius; y <= chunkViewRadius; y++)
+		{
+			if (!chunks.Contains(center + FIntPoint(x, y)))
+				missing.Add(center + FIntPoint(x, y));
+		}
+	}
+
+	missing.Sort([center](const FIntPoint& a, const FIntPoint& b) {
+		return (a - center).SizeSquared() < (b - center).SizeSquared();
+	});
+
+	//chunks share the generation state with the other generations, so a new one only starts once the running one is done.
+	//Chunks restored from the cache are finished right away, the first one which has to be built stops the loop
+	if (AAMapGenerator::IsGenerating())
+		return;
+
+	for (int i = 0; i < FMath::Min(chunksPerFrame, missing.Num()); i++)
+	{
+		if (!AAMapGenerator::GenerateChunk(missing[i]))
+			break;
+	}
+}
+
+
+// Starts the generation of a single chunk, in world pixel coordinates. Returns false if the chunk is built in a
+// background task, in which case FinishChunkGeneration is called on the game thread once its lands are ready
+bool AAMapGenerator::GenerateChunk(FIntPoint chunk)
+{
+	AAMapGenerator::SnapshotParameters();
+	noiseOffset = chunk * (params.mapSize - 1);
+	meshOffset = FVector2D(noiseOffset.X, noiseOffset.Y);
+
+	TArray<ALand*> lands = TArray<ALand*>();
+	if (params.useTileCache && AAMapGenerator::RestoreTileFromCache(chunk, lands))
+	{
+		AAMapGenerator::AddChunk(chunk, lands);
+		return true;
+	}
+
+	if (!FPlatformProcess::SupportsMultithreading())
+	{
+		AAMapGenerator::GenerateChunkData();
+		AAMapGenerator::FinishChunkGeneration(chunk);
+		return true;
+	}
+
+	//same as GenerateMapDataAsync, the task only works on the generation state and the copied parameters
+	asyncGenerationRunning = true;
+	TWeakObjectPtr<AAMapGenerator> weakThis = this;
+	generationTask = Async(EAsyncExecution::ThreadPool, [this, weakThis, chunk]()
+	{
+		AAMapGenerator::GenerateChunkData();
+
+		AsyncTask(ENamedThreads::GameThread, [weakThis, chunk]()
+		{
+			if (weakThis.IsValid())
+				weakThis->FinishChunkGeneration(chunk);
+		});
+	});
+	return false;
+}
+
+
+// Builds the lands of a chunk in the generation state. It does not touch any actor, so it can run on any thread
+void AAMapGenerator::GenerateChunkData()
+{
+	AAMapGenerator::GenerateNoise();
+	AAMapGenerator::TerraceNoise();
+	AAMapGenerator::ClusterNoise();
+	generationState.LabelIslands(noiseBandHeight, !params.multithreadedGeneration);
+	AAMapGenerator::BuildLands();
+
+	if (params.useTileCache)
+		AAMapGenerator::PrepareBuiltTile();
+}
+
+
+// Game thread part of the generation of a chunk: spawns the lands which were built and stores them in the cache
+void AAMapGenerator::FinishChunkGeneration(FIntPoint chunk)
+{
+	asyncGenerationRunning = false;
+
+	TArray<ALand*> lands = TArray<ALand*>();
+	for (FLandMeshData& land : generationState.builtLands)
+		lands.Add(AAMapGenerator::SpawnLand(MoveTemp(land)));
+	generationState.builtLands.Reset();
+
+	AAMapGenerator::StoreBuiltTile(chunk);
+	AAMapGenerator::AddChunk(chunk, lands);
+}
+
+
+// Records the lands of a chunk, builds their components and spawns the props standing on them
+void AAMapGenerator::AddChunk(FIntPoint chunk, const TArray<ALand*>& lands)
+{
+	FTerrainChunk& terrainChunk = chunks.Add(chunk);
+	terrainChunk.lands = lands;
+	AAMapGenerator::UploadLands(lands);
+
+	//let the land meshes be built before props look for the surface to stand on
+	ChunkDoneDelegate.Broadcast(chunk);
+
+	AAMapGenerator::GenerateRockAndTrees();
+	chunks[chunk].props = spawnedProps;
+}
+
+
+void AAMapGenerator::EvictChunk(FIntPoint chunk)
+{
+	if (!chunks.Contains(chunk))
+		return;
+
+	ChunkEvictedDelegate.Broadcast(chunk);
+
+	FTerrainChunk terrainChunk;
+	if (!chunks.RemoveAndCopyValue(chunk, terrainChunk))
+		return;
+
+	//lands and props may have been destroyed elsewhere (level streaming, gameplay) since the chunk was generated
+	for (ALand* land : terrainChunk.lands)
+		generationState.ReleaseLand(land);
+	for (AActor* prop : terrainChunk.props)
+	{
+		if (IsValid(prop))
+			prop->Destroy();
+	}
 }
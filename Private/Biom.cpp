@@ -31,7 +31,7 @@ ABiom::ABiom()
 
 }
 
-TSubclassOf<AProp> ABiom::GetRandomProp()
+TSubclassOf<AProp> ABiom::GetRandomProp(float proba)
 {
 	if (ressources.Num() > 0)
 	{
@@ -53,9 +53,6 @@ TSubclassOf<AProp> ABiom::GetRandomProp()
 			}
 		}
 
-		//random float between 0 and 1
-		float proba = (float)(rand() % 1000) / 1000.0;
-
 		//find the object to spawn by sampling the ressources based on their individual probability
 		int idx = 0;
 		s = spawnProbabilities[0];
@@ -0,0 +1,64 @@
+// MIT License
+
+// Copyright (c) 2020 NielsPichon
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include "Public/CounterRandom.h"
+
+
+// SplitMix64 finalizer. Turns any 64 bits value into a well mixed one
+static uint64 SplitMix(uint64 z)
+{
+	z += 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+
+CounterRandom::CounterRandom(int seed, ERandomStage stage)
+{
+	streamKey = SplitMix(SplitMix((uint64)(uint32)seed) ^ (uint64)stage);
+}
+
+
+uint32 CounterRandom::Hash(int x, int y, int counter) const
+{
+	uint64 cell = ((uint64)(uint32)x << 32) | (uint64)(uint32)y;
+	return (uint32)(SplitMix(SplitMix(streamKey ^ cell) + (uint64)(uint32)counter) >> 32);
+}
+
+
+float CounterRandom::FRand(int x, int y, int counter) const
+{
+	// keep 24 bits so that the result is exactly representable and strictly below 1
+	return (float)(Hash(x, y, counter) >> 8) / 16777216.0f;
+}
+
+
+int CounterRandom::RandRange(int min, int max, int x, int y, int counter) const
+{
+	if (max <= min)
+		return min;
+
+	return min + (int)(Hash(x, y, counter) % (uint32)(max - min + 1));
+}
@@ -42,8 +42,8 @@ bool ALand::checkObjectFits(FVector position, float radius)
 	//debug.Append(FString::SanitizeFloat(position.Y));
 	//debug.Append(") (");
 
-	//for each edge
-	for (int i = 0; i < edges.Num() / 2; i+= 2) {
+	//for each edge (stored as pairs of points)
+	for (int i = 0; i + 1 < edges.Num(); i += 2) {
 
 		//if one or the other extreme edge point is too close, it means the object doesn't fit
 		if (FVector::Dist2D(position, edges[i]) < radius
@@ -106,6 +106,113 @@ bool ALand::checkObjectFits(FVector position, float radius)
 	return fits;
 }
 
+FLandMeshData ALand::GetMeshData() const
+{
+	FLandMeshData data;
+	data.verts = verts;
+	data.tris = tris;
+	data.uvs = uvs;
+	data.normals = normals;
+	data.tangents = tangents;
+	data.edges = edges;
+	data.level = level;
+	data.block = block;
+	data.bounds = bounds;
+	data.lods = lods;
+	return data;
+}
+
+void ALand::GetLODData(int lod, TArray<FVector>& outVerts, TArray<int>& outTris, TArray<FVector2D>& outUVs) const
+{
+	lod = FMath::Min(lod, lods.Num());
+	if (lod <= 0)
+	{
+		outVerts = verts;
+		outTris = tris;
+		outUVs = uvs;
+		return;
+	}
+
+	outVerts = lods[lod - 1].verts;
+	outTris = lods[lod - 1].tris;
+	outUVs = lods[lod - 1].uvs;
+}
+
+// Converts tangent directions to the procedural mesh tangents
+static TArray<FProcMeshTangent> ToProcMeshTangents(const TArray<FVector>& tangents)
+{
+	TArray<FProcMeshTangent> procTangents = TArray<FProcMeshTangent>();
+	procTangents.Reserve(tangents.Num());
+	for (const FVector& tangent : tangents)
+		procTangents.Add(FProcMeshTangent(tangent, false));
+	return procTangents;
+}
+
+void ALand::GetLODData(int lod, TArray<FVector>& outVerts, TArray<int>& outTris, TArray<FVector2D>& outUVs,
+	TArray<FVector>& outNormals, TArray<FProcMeshTangent>& outTangents) const
+{
+	GetLODData(lod, outVerts, outTris, outUVs);
+
+	lod = FMath::Min(lod, lods.Num());
+	outNormals = lod <= 0 ? normals : lods[lod - 1].normals;
+	outTangents = ToProcMeshTangents(lod <= 0 ? tangents : lods[lod - 1].tangents);
+}
+
+void ALand::SetMeshData(const FLandMeshData& data)
+{
+	verts = data.verts;
+	tris = data.tris;
+	uvs = data.uvs;
+	normals = data.normals;
+	tangents = data.tangents;
+	edges = data.edges;
+	level = data.level;
+	block = data.block;
+	bounds = data.bounds;
+	lods = data.lods;
+}
+
+void ALand::SetMeshData(FLandMeshData&& data)
+{
+	verts = MoveTemp(data.verts);
+	tris = MoveTemp(data.tris);
+	uvs = MoveTemp(data.uvs);
+	normals = MoveTemp(data.normals);
+	tangents = MoveTemp(data.tangents);
+	edges = MoveTemp(data.edges);
+	level = data.level;
+	block = data.block;
+	bounds = data.bounds;
+	lods = MoveTemp(data.lods);
+}
+
+void ALand::UploadMesh(UMaterialInterface* material, bool releaseData)
+{
+	if (!meshComponent)
+	{
+		meshComponent = NewObject<UProceduralMeshComponent>(this, TEXT("LandMesh"));
+		SetRootComponent(meshComponent);
+		meshComponent->RegisterComponent();
+	}
+
+	//the land has a single colour, the one of its biom
+	TArray<FLinearColor> colors = TArray<FLinearColor>();
+	colors.Init(biom ? biom->biomColor : FLinearColor::White, verts.Num());
+
+	meshComponent->CreateMeshSection_LinearColor(0, verts, tris, normals, uvs, colors, ToProcMeshTangents(tangents), true);
+	meshComponent->SetMaterial(0, material);
+
+	if (releaseData)
+	{
+		verts.Empty();
+		tris.Empty();
+		uvs.Empty();
+		normals.Empty();
+		tangents.Empty();
+		lods.Empty();
+	}
+}
+
 // Called when the game starts or when spawned
 void ALand::BeginPlay()
 {
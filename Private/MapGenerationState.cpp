@@ -0,0 +1,285 @@
+// MIT License
+
+// Copyright (c) 2020 NielsPichon
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include "Public/MapGenerationState.h"
+#include "Engine/World.h"
+#include "Async/ParallelFor.h"
+
+
+void FMapGenerationState::Reset(int _mapSize, bool withGradient)
+{
+	mapSize = _mapSize;
+
+	//shrinking is not allowed so that a smaller map keeps the memory of a bigger one
+	noiseMap.SetNumUninitialized(mapSize * mapSize, false);
+	levelMap.SetNumUninitialized(mapSize * mapSize, false);
+
+	if (withGradient)
+		noiseGradient.SetNumUninitialized(mapSize * mapSize, false);
+	else
+		noiseGradient.Reset();
+}
+
+
+void FMapGenerationState::ResetLevelMasks(int levelCount)
+{
+	levelMasks.SetNum(levelCount, false);
+	for (TBitArray<>& mask : levelMasks)
+		mask.Init(false, mapSize * mapSize);
+}
+
+
+void FMapGenerationState::ResetVertexGrids(int count)
+{
+	//the grids are left empty after each mesh, so they only need a full reset when the map size changes
+	for (TArray<int32>& grid : vertexGrids)
+	{
+		if (grid.Num() != mapSize * mapSize)
+			grid.Init(INDEX_NONE, mapSize * mapSize);
+	}
+
+	while (vertexGrids.Num() < count)
+		vertexGrids.AddDefaulted_GetRef().Init(INDEX_NONE, mapSize * mapSize);
+}
+
+
+// Root of the set of a pixel. Sets are always merged under the smallest root, so a root is the smallest pixel of its set
+// and the parent of a pixel is never after it
+static int32 FindIslandRoot(TArray<int32>& labels, int32 pixel)
+{
+	int32 root = pixel;
+	while (labels[root] != root)
+		root = labels[root];
+
+	//path compression
+	while (labels[pixel] != root)
+	{
+		int32 next = labels[pixel];
+		labels[pixel] = root;
+		pixel = next;
+	}
+
+	return root;
+}
+
+
+static void MergeIslands(TArray<int32>& labels, int32 a, int32 b)
+{
+	a = FindIslandRoot(labels, a);
+	b = FindIslandRoot(labels, b);
+	if (a < b)
+		labels[b] = a;
+	else if (b < a)
+		labels[a] = b;
+}
+
+
+void FMapGenerationState::LabelIslands(int bandHeight, bool singleThreaded)
+{
+	FMapGenerationState::BeginLabelIslands();
+
+	for (int level = 0; level < levelMasks.Num(); level++)
+		FMapGenerationState::LabelLevelIslands(level, bandHeight, singleThreaded);
+}
+
+
+void FMapGenerationState::BeginLabelIslands()
+{
+	int pixelCount = mapSize * mapSize;
+
+	islands.Reset();
+	levelIslands.SetNum(levelMasks.Num(), false);
+	islandMap.SetNumUninitialized(pixelCount, false);
+	islandLabels.SetNumUninitialized(pixelCount, false);
+	islandIds.SetNumUninitialized(pixelCount, false);
+	previousIslandIds.SetNumUninitialized(pixelCount, false);
+}
+
+
+void FMapGenerationState::LabelLevelIslands(int level, int bandHeight, bool singleThreaded)
+{
+	int pixelCount = mapSize * mapSize;
+	int bandCount = FMath::DivideAndRoundUp(mapSize, bandHeight);
+
+	const TBitArray<>& mask = levelMasks[level];
+	levelIslands[level].Reset();
+
+	//merge each pixel with its left and top neighbours. Bands only touch their own pixels so they can run in parallel
+	ParallelFor(bandCount, [&](int32 band)
+	{
+		int firstRow = band * bandHeight;
+		int lastRow = FMath::Min(firstRow + bandHeight, mapSize);
+		for (int i = firstRow; i < lastRow; i++)
+		{
+			for (int j = 0; j < mapSize; j++)
+			{
+				int idx = i * mapSize + j;
+				if (!mask[idx])
+				{
+					islandLabels[idx] = -1;
+					continue;
+				}
+
+				islandLabels[idx] = idx;
+				if (j > 0 && mask[idx - 1])
+					MergeIslands(islandLabels, idx, idx - 1);
+				if (i > firstRow && mask[idx - mapSize])
+					MergeIslands(islandLabels, idx, idx - mapSize);
+			}
+		}
+	}, singleThreaded);
+
+	//stitch the bands together along their first row
+	for (int band = 1; band < bandCount; band++)
+	{
+		int row = band * bandHeight;
+		for (int j = 0; j < mapSize; j++)
+		{
+			int idx = row * mapSize + j;
+			if (mask[idx] && mask[idx - mapSize])
+				MergeIslands(islandLabels, idx, idx - mapSize);
+		}
+	}
+
+	//a parent is never after its pixel, so in row order it is already resolved to its root. Roots open a new island
+	for (int idx = 0; idx < pixelCount; idx++)
+	{
+		if (islandLabels[idx] < 0)
+		{
+			islandIds[idx] = -1;
+			continue;
+		}
+
+		if (islandLabels[idx] == idx)
+		{
+			FTerrainIsland island;
+			island.level = level;
+			island.parent = level > 0 ? previousIslandIds[idx] : -1;
+			island.firstPixel = idx;
+			island.bounds = FIntRect(idx % mapSize, idx / mapSize, idx % mapSize + 1, idx / mapSize + 1);
+			islandIds[idx] = islands.Add(island);
+			levelIslands[level].Add(islandIds[idx]);
+		}
+		else
+		{
+			islandLabels[idx] = islandLabels[islandLabels[idx]];
+			islandIds[idx] = islandIds[islandLabels[idx]];
+		}
+
+		FTerrainIsland& island = islands[islandIds[idx]];
+		FIntPoint pixel = FIntPoint(idx % mapSize, idx / mapSize);
+		island.pixelCount++;
+		island.bounds.Min = island.bounds.Min.ComponentMin(pixel);
+		island.bounds.Max = island.bounds.Max.ComponentMax(pixel + FIntPoint(1, 1));
+
+		if (levelMap[idx] == level)
+			islandMap[idx] = islandIds[idx];
+	}
+
+	Swap(islandIds, previousIslandIds);
+}
+
+
+int FMapGenerationState::GetIslandAtLevel(int pixel, int level) const
+{
+	int island = islandMap[pixel];
+	while (island >= 0 && islands[island].level > level)
+		island = islands[island].parent;
+
+	return island >= 0 && islands[island].level == level ? island : -1;
+}
+
+
+ALand* FMapGenerationState::AcquireLand(UWorld* world)
+{
+	//pooled lands may have been destroyed with their level
+	while (landPool.Num() > 0)
+	{
+		ALand* land = landPool.Pop(false);
+		if (IsValid(land))
+			return land;
+	}
+
+	return world->SpawnActor<ALand>(FVector(0, 0, 0), FRotator(0, 0, 0));
+}
+
+
+void FMapGenerationState::ReleaseLand(ALand* land)
+{
+	if (!IsValid(land))
+		return;
+
+	//the arrays keep their memory for the next mesh
+	land->verts.Reset();
+	land->tris.Reset();
+	land->uvs.Reset();
+	land->normals.Reset();
+	land->tangents.Reset();
+	land->edges.Reset();
+	land->lods.Reset();
+	if (land->meshComponent)
+		land->meshComponent->ClearAllMeshSections();
+	land->biom = nullptr;
+	land->level = 0;
+	land->block = FIntPoint(-1, -1);
+	land->bounds = FBox(ForceInit);
+
+	landPool.Add(land);
+}
+
+
+ALandmark* FMapGenerationState::AcquireLandmark(UWorld* world, UClass* landmarkClass)
+{
+	for (int i = landmarkPool.Num() - 1; i >= 0; i--)
+	{
+		ALandmark* landmark = landmarkPool[i];
+		if (!IsValid(landmark))
+		{
+			landmarkPool.RemoveAtSwap(i);
+			continue;
+		}
+
+		if (landmark->GetClass() == landmarkClass)
+		{
+			landmarkPool.RemoveAtSwap(i);
+			landmark->SetActorHiddenInGame(false);
+			landmark->SetActorEnableCollision(true);
+			return landmark;
+		}
+	}
+
+	return Cast<ALandmark>(world->SpawnActor(landmarkClass));
+}
+
+
+void FMapGenerationState::ReleaseLandmark(ALandmark* landmark)
+{
+	if (!IsValid(landmark))
+		return;
+
+	landmark->SetActorHiddenInGame(true);
+	landmark->SetActorEnableCollision(false);
+
+	landmarkPool.Add(landmark);
+}
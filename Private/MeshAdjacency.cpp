@@ -0,0 +1,75 @@
+// MIT License
+
+// Copyright (c) 2020 NielsPichon
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include "Public/MeshAdjacency.h"
+
+
+MeshAdjacency::MeshAdjacency(const TArray<int>& tris)
+{
+	int32 triangleCount = tris.Num() / 3;
+
+	//edges are hashed on their sorted vertex pair
+	TMap<uint64, int32> edgeLookup = TMap<uint64, int32>();
+	edgeLookup.Reserve(tris.Num());
+	edges.Reserve(tris.Num());
+
+	for (int32 face = 0; face < triangleCount; face++)
+	{
+		int32 i1 = tris[face * 3 + 2];
+		for (int32 b = 0; b < 3; b++)
+		{
+			int32 i2 = tris[face * 3 + b];
+			uint64 key = ((uint64)(uint32)FMath::Min(i1, i2) << 32) | (uint32)FMath::Max(i1, i2);
+
+			int32* edgeIndex = edgeLookup.Find(key);
+			if (edgeIndex && edges[*edgeIndex].IsBoundary())
+			{
+				edges[*edgeIndex].face1 = face;
+			}
+			else
+			{
+				//new edge (or a third triangle on a non manifold edge, which starts a new one)
+				FMeshEdge edge;
+				edge.v0 = i1;
+				edge.v1 = i2;
+				edge.face0 = face;
+				edgeLookup.Add(key, edges.Add(edge));
+			}
+
+			i1 = i2;
+		}
+	}
+}
+
+
+TArray<FMeshEdge> MeshAdjacency::GetBoundaryEdges() const
+{
+	TArray<FMeshEdge> boundary = TArray<FMeshEdge>();
+	for (const FMeshEdge& edge : edges)
+	{
+		if (edge.IsBoundary())
+			boundary.Add(edge);
+	}
+	return boundary;
+}
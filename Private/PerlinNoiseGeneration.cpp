@@ -25,13 +25,27 @@
 #include <cmath>
 
 
-PerlinNoiseGeneration::PerlinNoiseGeneration(int _seed, int _mapSize, int _octaves, float _persistance, float _baseFreq)
+PerlinNoiseGeneration::PerlinNoiseGeneration(int _seed, int _mapSize, int _octaves, float _persistance, float _baseFreq, bool _legacyGradients)
+	: latticeRandom(_seed, ERandomStage::Noise)
 {
 	mapSize = _mapSize;
 	octaves = _octaves;
 	persistance = _persistance;
 	baseFreq = _baseFreq;
+	legacyGradients = _legacyGradients;
 
+	// The hashed lattice picks its gradients among a fixed set of directions evenly spread on the unit circle.
+	// This costs the same whatever the map size and amount of octaves.
+	for (int i = 0; i < gradientDirectionCount; i++) {
+		float angle = 2.0f * PI * (float)i / (float)gradientDirectionCount;
+		gradientDirections[2 * i] = cos(angle);
+		gradientDirections[2 * i + 1] = sin(angle);
+	}
+
+	if (!legacyGradients)
+		return;
+
+	// The legacy table deliberately keeps using the global srand/rand sequence so that older seeds give the same maps.
 	// We generate a map of size the map size (to the square) times the number of octaves.
 	// This works because we use few octaves and small maps.
 	gradient = new float[mapSize * mapSize * 2 * octaves * octaves];
@@ -56,6 +70,7 @@ PerlinNoiseGeneration::PerlinNoiseGeneration(int _seed, int _mapSize, int _octav
 
 PerlinNoiseGeneration::~PerlinNoiseGeneration()
 {
+	delete[] gradient;
 }
 
 
@@ -68,6 +83,12 @@ float PerlinNoiseGeneration::Fade(float t) {
 }
 
 
+// Derivative of the Fade function
+float PerlinNoiseGeneration::FadeDerivative(float t) {
+	return 30 * t * t * (t - 1) * (t - 1);
+}
+
+
 // Simple linear interpolation
 float PerlinNoiseGeneration::Lerp(float a, float b, float t) {
 	return (1 - t) * a + b * t;
@@ -80,7 +101,31 @@ float PerlinNoiseGeneration::DotGridGradient(int ix, int iy, float x, float y) {
 	float dy = y - (float)iy;
 
 	// Compute the dot-product
-	return (dx * gradient[2 * (iy + ix * mapSize)] + dy * gradient[2 * (iy + ix * mapSize) + 1]) /*/ sqrt(2)*/;
+	if (legacyGradients)
+		return (dx * gradient[2 * (iy + ix * mapSize)] + dy * gradient[2 * (iy + ix * mapSize) + 1]) /*/ sqrt(2)*/;
+
+	int g = HashGradientIndex(ix, iy);
+	return dx * gradientDirections[2 * g] + dy * gradientDirections[2 * g + 1];
+}
+
+// Retrieves the gradient of a lattice point
+void PerlinNoiseGeneration::GradientAt(int ix, int iy, float& gx, float& gy) {
+	if (legacyGradients)
+	{
+		gx = gradient[2 * (iy + ix * mapSize)];
+		gy = gradient[2 * (iy + ix * mapSize) + 1];
+		return;
+	}
+
+	int g = HashGradientIndex(ix, iy);
+	gx = gradientDirections[2 * g];
+	gy = gradientDirections[2 * g + 1];
+}
+
+// Hashes the lattice coordinates into one of the gradient directions.
+// The lattice is unbounded, so any coordinate (including negative ones) is valid.
+int PerlinNoiseGeneration::HashGradientIndex(int ix, int iy) {
+	return (int)(latticeRandom.Hash(ix, iy) % gradientDirectionCount);
 }
 
 // Compute Perlin noise at coordinates x, y
@@ -120,6 +165,82 @@ float PerlinNoiseGeneration::Perlin(float x, float y) {
 }
 
 
+// Compute Perlin noise at coordinates x, y together with its analytic derivative along x and y.
+// The value is computed exactly as in Perlin(x, y)
+float PerlinNoiseGeneration::Perlin(float x, float y, float& dx, float& dy) {
+
+	//we shift the points to avoid falling on a 0
+	float freqShift = 1 / (2 * baseFreq);
+
+	//set frequency and shift
+	float X = x / baseFreq + freqShift;
+	float Y = y / baseFreq + freqShift;
+
+	// Determine grid cell coordinates
+	int x0 = (int)floor(X);
+	int x1 = x0 + 1;
+	int y0 = (int)floor(Y);
+	int y1 = y0 + 1;
+
+	// Determine interpolation weights and their derivatives
+	float sx = PerlinNoiseGeneration::Fade(X - (float)x0);
+	float sy = PerlinNoiseGeneration::Fade(Y - (float)y0);
+	float dsx = PerlinNoiseGeneration::FadeDerivative(X - (float)x0);
+	float dsy = PerlinNoiseGeneration::FadeDerivative(Y - (float)y0);
+
+	// The derivative of each corner dot product is the corner gradient itself
+	float g00x, g00y, g10x, g10y, g01x, g01y, g11x, g11y;
+	PerlinNoiseGeneration::GradientAt(x0, y0, g00x, g00y);
+	PerlinNoiseGeneration::GradientAt(x1, y0, g10x, g10y);
+	PerlinNoiseGeneration::GradientAt(x0, y1, g01x, g01y);
+	PerlinNoiseGeneration::GradientAt(x1, y1, g11x, g11y);
+
+	float n00 = PerlinNoiseGeneration::DotGridGradient(x0, y0, X, Y);
+	float n10 = PerlinNoiseGeneration::DotGridGradient(x1, y0, X, Y);
+	float n01 = PerlinNoiseGeneration::DotGridGradient(x0, y1, X, Y);
+	float n11 = PerlinNoiseGeneration::DotGridGradient(x1, y1, X, Y);
+
+	float ix0 = PerlinNoiseGeneration::Lerp(n00, n10, sx);
+	float ix1 = PerlinNoiseGeneration::Lerp(n01, n11, sx);
+
+	// Derivatives of the two x interpolations
+	float dix0X = PerlinNoiseGeneration::Lerp(g00x, g10x, sx) + dsx * (n10 - n00);
+	float dix1X = PerlinNoiseGeneration::Lerp(g01x, g11x, sx) + dsx * (n11 - n01);
+	float dix0Y = PerlinNoiseGeneration::Lerp(g00y, g10y, sx);
+	float dix1Y = PerlinNoiseGeneration::Lerp(g01y, g11y, sx);
+
+	// Chain rule through the y interpolation, then through the scaling of the coordinates
+	dx = PerlinNoiseGeneration::Lerp(dix0X, dix1X, sy) / baseFreq;
+	dy = (PerlinNoiseGeneration::Lerp(dix0Y, dix1Y, sy) + dsy * (ix1 - ix0)) / baseFreq;
+
+	return PerlinNoiseGeneration::Lerp(ix0, ix1, sy);
+}
+
+
+// Perlin noise generation, together with its derivative along x and y
+float PerlinNoiseGeneration::PerlinNoiseValue(float x, float y, float& dx, float& dy) {
+	float noise = 0;
+	float persist = 1;
+	float frequency = 1;
+	float totAmplitude = 0;
+	dx = 0;
+	dy = 0;
+	for (int i = 0; i < octaves; i++) {
+		float octaveDx, octaveDy;
+		noise += persist * PerlinNoiseGeneration::Perlin(x * frequency, y * frequency, octaveDx, octaveDy);
+		dx += persist * frequency * octaveDx;
+		dy += persist * frequency * octaveDy;
+		totAmplitude += persist;
+		persist *= persistance;
+		frequency *= 2;
+	}
+
+	dx *= 0.5 / totAmplitude;
+	dy *= 0.5 / totAmplitude;
+	return (noise / totAmplitude + 1.0) * 0.5;
+}
+
+
 // Perlin noise generation
 float PerlinNoiseGeneration::PerlinNoiseValue(float x, float y) {
 	float noise = 0;
@@ -135,3 +256,162 @@ float PerlinNoiseGeneration::PerlinNoiseValue(float x, float y) {
 
 	return (noise / totAmplitude + 1.0) * 0.5;
 }
+
+
+// Perlin noise generation for a whole row of samples
+void PerlinNoiseGeneration::PerlinNoiseRow(float x, float y, int count, float* outValues, bool vectorized, float* outDx, float* outDy) {
+#if !PLATFORM_ENABLE_VECTORINTRINSICS
+	vectorized = false;
+#endif
+
+	// The value and its derivative are computed in the same pass
+	bool derivatives = outDx && outDy;
+
+	if (!vectorized)
+	{
+		for (int k = 0; k < count; k++)
+		{
+			if (derivatives)
+				outValues[k] = PerlinNoiseGeneration::PerlinNoiseValue(x, y + k, outDx[k], outDy[k]);
+			else
+				outValues[k] = PerlinNoiseGeneration::PerlinNoiseValue(x, y + k);
+		}
+		return;
+	}
+
+	for (int k = 0; k < count; k++)
+		outValues[k] = 0;
+	if (derivatives)
+	{
+		for (int k = 0; k < count; k++)
+		{
+			outDx[k] = 0;
+			outDy[k] = 0;
+		}
+	}
+
+	float persist = 1;
+	float frequency = 1;
+	float totAmplitude = 0;
+	for (int i = 0; i < octaves; i++) {
+		PerlinNoiseGeneration::PerlinRowVectorized(x, y, frequency, persist, count, outValues, derivatives ? outDx : nullptr, derivatives ? outDy : nullptr);
+		totAmplitude += persist;
+		persist *= persistance;
+		frequency *= 2;
+	}
+
+	for (int k = 0; k < count; k++)
+		outValues[k] = (outValues[k] / totAmplitude + 1.0) * 0.5;
+
+	if (derivatives)
+	{
+		for (int k = 0; k < count; k++)
+		{
+			outDx[k] *= 0.5 / totAmplitude;
+			outDy[k] *= 0.5 / totAmplitude;
+		}
+	}
+}
+
+
+// Accumulates one octave of Perlin noise, times the amplitude, along a row. When outDx and outDy are given, the
+// derivatives of the octave are accumulated too, with the same chain rule as in Perlin(x, y, dx, dy).
+// The lattice lookups are gathered per sample, the interpolation is then done 4 samples at a time.
+void PerlinNoiseGeneration::PerlinRowVectorized(float x, float y, float frequency, float amplitude, int count, float* outValues, float* outDx, float* outDy) {
+	float freqShift = 1 / (2 * baseFreq);
+
+	// The row has a constant x, so the x part of the lattice is shared by all the samples
+	float X = x * frequency / baseFreq + freqShift;
+	int x0 = (int)floor(X);
+	float fx = X - (float)x0;
+	float sx = PerlinNoiseGeneration::Fade(fx);
+	float dsx = PerlinNoiseGeneration::FadeDerivative(fx);
+
+	const VectorRegister vFx = VectorSetFloat1(fx);
+	const VectorRegister vFxMinusOne = VectorSetFloat1(fx - 1);
+	const VectorRegister vSx = VectorSetFloat1(sx);
+	const VectorRegister vOne = VectorSetFloat1(1);
+	const VectorRegister vSix = VectorSetFloat1(6);
+	const VectorRegister vFifteen = VectorSetFloat1(15);
+	const VectorRegister vTen = VectorSetFloat1(10);
+	const VectorRegister vAmplitude = VectorSetFloat1(amplitude);
+	const VectorRegister vDsx = VectorSetFloat1(dsx);
+	const VectorRegister vThirty = VectorSetFloat1(30);
+
+	// the derivative of an octave is scaled by its amplitude, and by its frequency through the scaling of the coordinates
+	const VectorRegister vDerivativeScale = VectorSetFloat1(amplitude * frequency / baseFreq);
+
+	float fy[4], g00x[4], g00y[4], g10x[4], g10y[4], g01x[4], g01y[4], g11x[4], g11y[4], result[4], resultDx[4], resultDy[4];
+
+	for (int k = 0; k < count; k += 4)
+	{
+		int lanes = FMath::Min(4, count - k);
+		for (int l = 0; l < 4; l++)
+		{
+			// pad the last block by repeating the last sample
+			float Y = (y + k + FMath::Min(l, lanes - 1)) * frequency / baseFreq + freqShift;
+			int y0 = (int)floor(Y);
+			fy[l] = Y - (float)y0;
+
+			PerlinNoiseGeneration::GradientAt(x0, y0, g00x[l], g00y[l]);
+			PerlinNoiseGeneration::GradientAt(x0 + 1, y0, g10x[l], g10y[l]);
+			PerlinNoiseGeneration::GradientAt(x0, y0 + 1, g01x[l], g01y[l]);
+			PerlinNoiseGeneration::GradientAt(x0 + 1, y0 + 1, g11x[l], g11y[l]);
+		}
+
+		VectorRegister vFy = VectorLoad(fy);
+		VectorRegister vFyMinusOne = VectorSubtract(vFy, vOne);
+
+		// sy = fy^3 * (fy * (6 * fy - 15) + 10)
+		VectorRegister vSy = VectorSubtract(VectorMultiply(vFy, vSix), vFifteen);
+		vSy = VectorMultiplyAdd(vFy, vSy, vTen);
+		vSy = VectorMultiply(VectorMultiply(VectorMultiply(vFy, vFy), vFy), vSy);
+
+		// dot products of the distance and gradient vectors at the 4 corners of the cell
+		VectorRegister n00 = VectorMultiplyAdd(vFy, VectorLoad(g00y), VectorMultiply(vFx, VectorLoad(g00x)));
+		VectorRegister n10 = VectorMultiplyAdd(vFy, VectorLoad(g10y), VectorMultiply(vFxMinusOne, VectorLoad(g10x)));
+		VectorRegister n01 = VectorMultiplyAdd(vFyMinusOne, VectorLoad(g01y), VectorMultiply(vFx, VectorLoad(g01x)));
+		VectorRegister n11 = VectorMultiplyAdd(vFyMinusOne, VectorLoad(g11y), VectorMultiply(vFxMinusOne, VectorLoad(g11x)));
+
+		// lerp along x then along y
+		VectorRegister ix0 = VectorMultiplyAdd(VectorSubtract(n10, n00), vSx, n00);
+		VectorRegister ix1 = VectorMultiplyAdd(VectorSubtract(n11, n01), vSx, n01);
+		VectorRegister value = VectorMultiplyAdd(VectorSubtract(ix1, ix0), vSy, ix0);
+
+		VectorStore(VectorMultiply(value, vAmplitude), result);
+		for (int l = 0; l < lanes; l++)
+			outValues[k + l] += result[l];
+
+		if (!outDx || !outDy)
+			continue;
+
+		// dsy = 30 * fy^2 * (fy - 1)^2
+		VectorRegister vDsy = VectorMultiply(vFy, vFyMinusOne);
+		vDsy = VectorMultiply(VectorMultiply(vDsy, vDsy), vThirty);
+
+		// the derivative of each corner dot product is the corner gradient itself
+		VectorRegister g00xv = VectorLoad(g00x);
+		VectorRegister g01xv = VectorLoad(g01x);
+		VectorRegister g00yv = VectorLoad(g00y);
+		VectorRegister g01yv = VectorLoad(g01y);
+		VectorRegister dix0X = VectorMultiplyAdd(VectorSubtract(VectorLoad(g10x), g00xv), vSx, g00xv);
+		dix0X = VectorMultiplyAdd(vDsx, VectorSubtract(n10, n00), dix0X);
+		VectorRegister dix1X = VectorMultiplyAdd(VectorSubtract(VectorLoad(g11x), g01xv), vSx, g01xv);
+		dix1X = VectorMultiplyAdd(vDsx, VectorSubtract(n11, n01), dix1X);
+		VectorRegister dix0Y = VectorMultiplyAdd(VectorSubtract(VectorLoad(g10y), g00yv), vSx, g00yv);
+		VectorRegister dix1Y = VectorMultiplyAdd(VectorSubtract(VectorLoad(g11y), g01yv), vSx, g01yv);
+
+		// chain rule through the y interpolation
+		VectorRegister dX = VectorMultiplyAdd(VectorSubtract(dix1X, dix0X), vSy, dix0X);
+		VectorRegister dY = VectorMultiplyAdd(VectorSubtract(dix1Y, dix0Y), vSy, dix0Y);
+		dY = VectorMultiplyAdd(vDsy, VectorSubtract(ix1, ix0), dY);
+
+		VectorStore(VectorMultiply(dX, vDerivativeScale), resultDx);
+		VectorStore(VectorMultiply(dY, vDerivativeScale), resultDy);
+		for (int l = 0; l < lanes; l++)
+		{
+			outDx[k + l] += resultDx[l];
+			outDy[k + l] += resultDy[l];
+		}
+	}
+}
@@ -23,6 +23,7 @@
 
 #include "public/RockMesh.h"
 #include "Runtime/Engine/Classes/Engine/StaticMesh.h"
+#include "Public/CounterRandom.h"
 
 // Sets default values
 ARockMesh::ARockMesh()
@@ -32,16 +33,34 @@ ARockMesh::ARockMesh()
 	RockMesh = CreateDefaultSubobject<UStaticMeshComponent>(TEXT("Rock"));
 	RockMesh->AttachToComponent(RootComponent,FAttachmentTransformRules::KeepWorldTransform);
 
-	if (MeshCandidates.Num() > 0)
-		RockMesh->SetStaticMesh(MeshCandidates[rand() % MeshCandidates.Num()]);
-
 }
 
 // Called when the game starts or when spawned
 void ARockMesh::BeginPlay()
 {
 	Super::BeginPlay();
-	
+
+	//The candidates are only known once the blueprint defaults are applied, so the mesh is picked here.
+	//Meshes spawned by the map generator are picked again once it has set their seed and cell
+	ARockMesh::PickMesh();
+}
+
+// Called by the map generator with its seed and the cell of the prop
+void ARockMesh::InitMesh(int newSeed, FIntPoint newCell)
+{
+	seed = newSeed;
+	cell = newCell;
+	ARockMesh::PickMesh();
+}
+
+// The pick only depends on the seed and the cell, not on the order the actors are spawned in
+void ARockMesh::PickMesh()
+{
+	if (MeshCandidates.Num() > 0)
+	{
+		CounterRandom random(seed, ERandomStage::PropMeshes);
+		RockMesh->SetStaticMesh(MeshCandidates[random.RandRange(0, MeshCandidates.Num() - 1, cell.X, cell.Y)]);
+	}
 }
 
 // Called every frame
@@ -0,0 +1,202 @@
+// MIT License
+
+// Copyright (c) 2020 NielsPichon
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include "Public/TileCache.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/Crc.h"
+#include "Misc/Guid.h"
+#include "HAL/FileManager.h"
+#include "Serialization/MemoryWriter.h"
+#include "Serialization/MemoryReader.h"
+#include "Async/Async.h"
+
+// Bump whenever the layout of a cached tile changes so that old files are ignored
+static const int32 tileCacheVersion = 6;
+
+
+TileCache::TileCache()
+{
+	capacity = 16;
+	useDisk = false;
+}
+
+
+TileCache::~TileCache()
+{
+	for (TPair<FString, TFuture<void>>& write : pendingWrites)
+		write.Value.Wait();
+}
+
+
+void TileCache::Configure(int _capacity, bool _useDisk)
+{
+	capacity = FMath::Max(_capacity, 0);
+	useDisk = _useDisk;
+	Trim();
+}
+
+
+bool TileCache::Find(const FString& key, FCachedTile& outTile)
+{
+	if (TSharedPtr<FCachedTile, ESPMode::ThreadSafe>* tile = tiles.Find(key))
+	{
+		outTile = **tile;
+		Touch(key);
+		return true;
+	}
+
+	//if not in memory anymore, try the disk and bring the tile back in memory
+	if (useDisk)
+		TileCache::WaitForWrite(GetFilePath(key));
+	if (useDisk && LoadFromDisk(key, outTile))
+	{
+		if (capacity > 0)
+		{
+			tiles.Add(key, MakeShared<FCachedTile, ESPMode::ThreadSafe>(outTile));
+			Touch(key);
+			Trim();
+		}
+		return true;
+	}
+
+	return false;
+}
+
+
+void TileCache::Add(const FString& key, const FCachedTile& tile)
+{
+	TileCache::Add(key, MakeShared<FCachedTile, ESPMode::ThreadSafe>(tile));
+}
+
+
+void TileCache::Add(const FString& key, FCachedTileRef tile)
+{
+	if (useDisk)
+	{
+		//a single write per file at a time, so that the last tile added is the one which ends up on disk
+		FString path = GetFilePath(key);
+		TileCache::WaitForWrite(path);
+
+		//the task keeps the tile alive, even if it is dropped from memory before the file is written
+		if (FPlatformProcess::SupportsMultithreading())
+			pendingWrites.Add(path, Async(EAsyncExecution::ThreadPool, [path, key, tile]() { TileCache::SaveToDisk(path, key, *tile); }));
+		else
+			TileCache::SaveToDisk(path, key, *tile);
+	}
+
+	if (capacity <= 0)
+		return;
+
+	tiles.Add(key, tile);
+	Touch(key);
+	Trim();
+}
+
+
+// Files are named after a hash of the key. The full key is stored in the file to rule out collisions
+FString TileCache::GetFilePath(const FString& key) const
+{
+	return FPaths::ProjectSavedDir() / TEXT("TileCache") / FString::Printf(TEXT("%08x.tile"), FCrc::StrCrc32(*key));
+}
+
+
+bool TileCache::LoadFromDisk(const FString& key, FCachedTile& outTile) const
+{
+	TArray<uint8> bytes;
+	if (!FFileHelper::LoadFileToArray(bytes, *GetFilePath(key), FILEREAD_Silent))
+		return false;
+
+	FMemoryReader reader(bytes);
+	int32 version = 0;
+	FString storedKey;
+	reader << version;
+	if (version != tileCacheVersion)
+		return false;
+	reader << storedKey;
+	if (storedKey != key)
+		return false;
+
+	reader << outTile.levelMap;
+	reader << outTile.noiseGradient;
+	reader << outTile.lands;
+	return !reader.IsError();
+}
+
+
+// The tile is taken by copy as the archive operators need mutable values, while the cached tile is shared.
+// It is written to a temporary file first and moved in place, so that a file on disk is always complete
+void TileCache::SaveToDisk(const FString& path, const FString& key, FCachedTile tile)
+{
+	TArray<uint8> bytes;
+	FMemoryWriter writer(bytes);
+	int32 version = tileCacheVersion;
+	FString storedKey = key;
+	writer << version;
+	writer << storedKey;
+	writer << tile.levelMap;
+	writer << tile.noiseGradient;
+	writer << tile.lands;
+
+	//several generators may share the cache directory, so the temporary file is unique
+	FString tempPath = FString::Printf(TEXT("%s.%s.tmp"), *path, *FGuid::NewGuid().ToString());
+	if (!FFileHelper::SaveArrayToFile(bytes, *tempPath))
+		return;
+
+	if (!IFileManager::Get().Move(*path, *tempPath, true))
+		IFileManager::Get().Delete(*tempPath, false, false, true);
+}
+
+
+// Waits for the pending write of a file, if any, and forgets the writes which are done
+void TileCache::WaitForWrite(const FString& path)
+{
+	if (TFuture<void>* write = pendingWrites.Find(path))
+		write->Wait();
+
+	for (auto it = pendingWrites.CreateIterator(); it; ++it)
+	{
+		if (it.Value().IsReady())
+			it.RemoveCurrent();
+	}
+}
+
+
+// Moves a key to the most recently used end
+void TileCache::Touch(const FString& key)
+{
+	usageOrder.Remove(key);
+	usageOrder.Add(key);
+}
+
+
+// Drops the least recently used tiles until the capacity is met
+void TileCache::Trim()
+{
+	while (usageOrder.Num() > capacity)
+	{
+		tiles.Remove(usageOrder[0]);
+		usageOrder.RemoveAt(0);
+	}
+}
@@ -23,6 +23,7 @@
 
 #include "public/TreeMesh.h"
 #include "Runtime/Engine/Classes/Engine/StaticMesh.h"
+#include "Public/CounterRandom.h"
 
 // Sets default values
 ATreeMesh::ATreeMesh()
@@ -32,16 +33,34 @@ ATreeMesh::ATreeMesh()
 
 	TreeMesh = CreateDefaultSubobject<UStaticMeshComponent>(TEXT("Tree"));
 	TreeMesh->AttachToComponent(RootComponent, FAttachmentTransformRules::KeepWorldTransform);
-
-	if (MeshCandidates.Num() > 0)
-		TreeMesh->SetStaticMesh(MeshCandidates[rand() % MeshCandidates.Num()]);
 }
 
 // Called when the game starts or when spawned
 void ATreeMesh::BeginPlay()
 {
 	Super::BeginPlay();
-	
+
+	//The candidates are only known once the blueprint defaults are applied, so the mesh is picked here.
+	//Meshes spawned by the map generator are picked again once it has set their seed and cell
+	ATreeMesh::PickMesh();
+}
+
+// Called by the map generator with its seed and the cell of the prop
+void ATreeMesh::InitMesh(int newSeed, FIntPoint newCell)
+{
+	seed = newSeed;
+	cell = newCell;
+	ATreeMesh::PickMesh();
+}
+
+// The pick only depends on the seed and the cell, not on the order the actors are spawned in
+void ATreeMesh::PickMesh()
+{
+	if (MeshCandidates.Num() > 0)
+	{
+		CounterRandom random(seed, ERandomStage::PropMeshes);
+		TreeMesh->SetStaticMesh(MeshCandidates[random.RandRange(0, MeshCandidates.Num() - 1, cell.X, cell.Y)]);
+	}
 }
 
 // Called every frame
@@ -8,25 +8,149 @@
 #include "Landmark.h"
 #include "Engine/Texture2D.h"
 #include "Biom.h"
+#include "PerlinNoiseGeneration.h"
+#include "TileCache.h"
+#include "MapGenerationState.h"
+#include "MeshAdjacency.h"
+#include "Async/Future.h"
 
 #include "AMapGenerator.generated.h"
 
+
+//Stages of the generation of a map, in the order they run
+UENUM(BlueprintType)
+enum class EGenerationStage : uint8
+{
+	Noise,
+	Landmarks,
+	Terrace,
+	Cluster,
+	Islands,
+	Mesh,
+	Cache,
+	Spawn
+};
+
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE(FGenerationDoneDelegate);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FGenerationProgressDelegate, EGenerationStage, stage, float, progress);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FChunkDelegate, FIntPoint, chunk);
+
+
+//Copy of the properties a generation depends on, taken when it begins. The background task and the later
+//stages only read this copy, so the properties can be changed from the game thread while a map is generated
+struct FMapGenerationParams
+{
+	int mapSize = 256;
+	int seed = 0;
+	int mapLevels = 10;
+	float globalScale = 100;
+	float heightScale = 10;
+	bool AddRiver = true;
+	int riverWidthFactor = 4;
+	bool multithreadedGeneration = true;
+	float weldTolerance = 0.1;
+	bool greedyTopMesh = false;
+	bool visibleSurfaceOnly = false;
+	bool meshPerIsland = false;
+	int landBlockSize = 0;
+	int lodCount = 1;
+	bool mergeLandsByBiom = false;
+	int octaves = 3;
+	float persistance = 0.5;
+	float baseFrequency = 5;
+	int noiseExponent = 1;
+	bool legacyNoise = false;
+	bool vectorizedNoise = true;
+	bool storeNoiseGradient = false;
+	bool streamChunks = false;
+	FVector2D chunkNoiseRange = FVector2D(0.25, 0.75);
+	bool useTileCache = true;
+	int amountOfLandmarks = 10;
+	TArray<TSubclassOf<ALandmark>> potentialLandmarks;
+
+	//biomSeparation of each biom, from the lowest biom up
+	TArray<float> biomSeparations;
+};
+
+
+//Phases of the build of a land, in the order they run. Each level of detail goes from Top to Weld
+enum class ELandBuildPhase : uint8
+{
+	Top,
+	Boundary,
+	Simplify,
+	Extrude,
+	Weld,
+	Split,
+	Done
+};
+
+
+//Land being built, one phase at a time
+struct FLandBuild
+{
+	//level and island of the land
+	int depth = 0;
+	int island = -1;
+
+	ELandBuildPhase phase = ELandBuildPhase::Top;
+
+	//level of detail being built
+	int lod = 0;
+
+	//full resolution land, the lower levels of detail are added to it once built
+	FLandMeshData land;
+
+	//level of detail being built and its boundary
+	FLandMeshData mesh;
+	TArray<FMeshEdge> edges;
+
+	//block of the face owning each boundary edge of the full resolution land, when the land is split in blocks
+	TArray<FIntPoint> edgeBlocks;
+
+	//blocks of the finished land
+	TArray<FLandMeshData> blocks;
+};
+
+
+//Progress of a time sliced generation, resumed from one frame to the next
+struct FSlicedGeneration
+{
+	bool running = false;
+
+	EGenerationStage stage = EGenerationStage::Noise;
+
+	//unit of work reached in the current stage (band of rows, landmark, level or land)
+	int step = 0;
+
+	//noise generator and range of the noise stage
+	TUniquePtr<PerlinNoiseGeneration> noiseGenerator;
+	float minNoise = 100;
+	float maxNoise = -1;
+
+	//lands built by the mesh stage, as (level, island)
+	TArray<FIntPoint> landJobs;
+
+	//land the mesh stage is building, null between two lands
+	TUniquePtr<FLandBuild> landBuild;
+};
+
+
+//Actors making up one streamed chunk of terrain
 USTRUCT()
-struct FEdgeData
+struct FTerrainChunk
 {
 	GENERATED_BODY()
 
 	UPROPERTY()
-		FVector2D vertexIndex;
+		TArray<ALand*> lands;
 
 	UPROPERTY()
-		FVector2D faceIndex;
+		TArray<AActor*> props;
 };
 
 
-DECLARE_DYNAMIC_MULTICAST_DELEGATE(FGenerationDoneDelegate);
-
-
 UCLASS()
 class TREASUREHUNT_API AAMapGenerator : public AActor
 {
@@ -46,7 +170,7 @@ public:
 		int seed = 0;
 
 	//Number of terraces in the level
-	UPROPERTY(EditAnywhere, Category = "Map Parameters")
+	UPROPERTY(EditAnywhere, Category = "Map Parameters", meta = (ClampMin = "2", ClampMax = "255"))
 		int mapLevels = 10;
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Map Parameters")
@@ -64,6 +188,47 @@ public:
 	UPROPERTY(EditAnywhere, Category = "Map Parameters")
 		int riverWidthFactor = 4;
 
+	//Spread the generation stages which support it over all cores. The result is the same as single threaded
+	UPROPERTY(EditAnywhere, Category = "Map Parameters")
+		bool multithreadedGeneration = true;
+
+	//Vertices of a land closer than this distance (in pixels) are welded together after extrusion
+	UPROPERTY(EditAnywhere, Category = "Map Parameters", meta = (ClampMin = "0"))
+		float weldTolerance = 0.1;
+
+	//Merge the flat cells of each terrace top in rectangles rather than using 2 triangles per pixel
+	UPROPERTY(EditAnywhere, Category = "Map Parameters")
+		bool greedyTopMesh = false;
+
+	//Only build the part of each terrace top which is not covered by the levels above, plus the walls between levels.
+	//The hidden tops and the bottom caps of the lands are skipped
+	UPROPERTY(EditAnywhere, Category = "Map Parameters")
+		bool visibleSurfaceOnly = false;
+
+	//Build a separate land for each island (connected area) of each level rather than one land per level
+	UPROPERTY(EditAnywhere, Category = "Map Parameters")
+		bool meshPerIsland = false;
+
+	//Time budget (in milliseconds) given each frame to GenerateMapDataTimeSliced. A single unit of work (a band of rows,
+	//a landmark, a level, a phase of the mesh of a land or the collision of a land) is never split. The mesh and collision
+	//of a land grow with its size, so meshPerIsland and landBlockSize keep the slices short on big maps
+	UPROPERTY(EditAnywhere, Category = "Map Parameters", meta = (ClampMin = "0.1"))
+		float generationFrameBudget = 8;
+
+	//Split the lands in square blocks of this size (in pixels), each with its own buffers and bounds, so that the
+	//renderer can cull them on their own. 0 keeps a single land per level (or island)
+	UPROPERTY(EditAnywhere, Category = "Map Parameters", meta = (ClampMin = "0"))
+		int landBlockSize = 0;
+
+	//Amount of levels of detail of each land. Each level halves the resolution of the grid its terraces are built from
+	UPROPERTY(EditAnywhere, Category = "Map Parameters", meta = (ClampMin = "1", ClampMax = "5"))
+		int lodCount = 1;
+
+	//Merge the lands of all the levels which share a biom (per block when lands are split in blocks),
+	//so that there is one mesh per biom rather than one per level
+	UPROPERTY(EditAnywhere, Category = "Map Parameters")
+		bool mergeLandsByBiom = false;
+
 	//Number of octaves to use in the Perlin noise for the map generation
 	UPROPERTY(EditAnywhere, Category = "Noise Parameters")
 		int octaves = 3;
@@ -80,6 +245,51 @@ public:
 	UPROPERTY(EditAnywhere, Category = "Noise Parameters")
 		int noiseExponent = 1;
 
+	//Use the legacy per pixel gradient table rather than the hashed lattice. Keeps the maps of older seeds,
+	//but the table grows with mapSize^2 * octaves^2
+	UPROPERTY(EditAnywhere, Category = "Noise Parameters")
+		bool legacyNoise = false;
+
+	//Evaluate the noise 4 samples at a time with vector intrinsics (falls back to scalar code when not available)
+	UPROPERTY(EditAnywhere, Category = "Noise Parameters")
+		bool vectorizedNoise = true;
+
+	//Compute the analytic gradient of the noise together with its value and keep it alongside the noise map,
+	//so that slope aware stages can read the steepness without sampling the neighbouring pixels
+	UPROPERTY(EditAnywhere, Category = "Noise Parameters")
+		bool storeNoiseGradient = false;
+
+	//Stream the terrain in chunks around the player rather than generating a single map.
+	//In that mode mapSize is the size of a chunk, landmarks, river and clouds are not generated
+	UPROPERTY(EditAnywhere, Category = "Streaming")
+		bool streamChunks = false;
+
+	//Radius (in chunks) around the player within which chunks are generated. Chunks further than one more chunk are evicted
+	UPROPERTY(EditAnywhere, Category = "Streaming")
+		int chunkViewRadius = 2;
+
+	//Maximum amount of chunks finished in a single frame. Chunks which are not in the cache are built one at a time
+	//in a background task, then spawned on the game thread
+	UPROPERTY(EditAnywhere, Category = "Streaming")
+		int chunksPerFrame = 1;
+
+	//As there is no whole map to normalize over, this range of noise values is mapped to the full height when streaming
+	UPROPERTY(EditAnywhere, Category = "Streaming")
+		FVector2D chunkNoiseRange = FVector2D(0.25, 0.75);
+
+	//Keep the finished tiles (the whole map or streamed chunks) so that generating them again with the same parameters is skipped.
+	//Ignored for a single map with randomSeed, as it is never generated twice
+	UPROPERTY(EditAnywhere, Category = "Cache")
+		bool useTileCache = true;
+
+	//Amount of tiles kept in memory
+	UPROPERTY(EditAnywhere, Category = "Cache")
+		int tileCacheCapacity = 16;
+
+	//Also store the tiles in the Saved folder so that they are reused across sessions
+	UPROPERTY(EditAnywhere, Category = "Cache")
+		bool diskTileCache = false;
+
 	//Threshold in height at which bioms change
 	UPROPERTY(EditAnywhere, Category = "Bioms")
 		TArray< TSubclassOf<ABiom>> bioms;
@@ -105,15 +315,45 @@ public:
 	UPROPERTY(EditAnywhere, Category = "Props")
 		int cloudAmount = 10;
 
+	//Props are not spawned where the terrain climbs more than this amount of levels per pixel.
+	//Requires storeNoiseGradient, 0 disables the test
+	UPROPERTY(EditAnywhere, Category = "Props")
+		float maxPropSlope = 0;
+
 	UPROPERTY(BlueprintAssignable, Category = "Events")
 	FGenerationDoneDelegate LandDoneDelegate;
 
 	UPROPERTY(BlueprintAssignable, Category = "Events")
 		FGenerationDoneDelegate PropsDoneDelegate;
 
+	//Called on the game thread each time a stage of the map generation is done, with the overall progress (0 to 1)
+	UPROPERTY(BlueprintAssignable, Category = "Events")
+		FGenerationProgressDelegate GenerationProgressDelegate;
+
+	//Called once the land of a streamed chunk is ready, before it gets populated with props
+	UPROPERTY(BlueprintAssignable, Category = "Events")
+		FChunkDelegate ChunkDoneDelegate;
+
+	//Called right before the actors of a streamed chunk are destroyed
+	UPROPERTY(BlueprintAssignable, Category = "Events")
+		FChunkDelegate ChunkEvictedDelegate;
+
 	UPROPERTY(BlueprintReadOnly, Category = "Map")
 		TArray<ALand*> meshes;
 
+	//Build a procedural mesh component on each land from C++ once it is generated, rather than through GetMeshData
+	//from Blueprint. Requires the ProceduralMeshComponent module
+	UPROPERTY(EditAnywhere, Category = "Map")
+		bool createLandComponents = false;
+
+	//Material of the land components
+	UPROPERTY(EditAnywhere, Category = "Map")
+		UMaterialInterface* landMaterial = nullptr;
+
+	//Free the geometry kept on the lands once their component is built. GetMeshData returns empty meshes afterwards
+	UPROPERTY(EditAnywhere, Category = "Map")
+		bool releaseLandData = false;
+
 	//should the map texture be smoothed
 	UPROPERTY(EditAnywhere, Category = "Map")
 		bool smoothMapTexture = false;
@@ -141,14 +381,49 @@ public:
 	UPROPERTY(BlueprintReadOnly, Category = "Missions")
 		TArray<ALandmark*> landmarks;
 
+	//Generates the map then calls LandDoneDelegate. Returns false, without generating anything nor calling
+	//LandDoneDelegate, when a map is already being generated
+	UFUNCTION(BlueprintCallable)
+		bool GenerateMapData();
+
+	//Same as GenerateMapData, but the stages run in a background task so that the game thread keeps running.
+	//The actors are spawned on the game thread at the end, then LandDoneDelegate is called
+	UFUNCTION(BlueprintCallable)
+		bool GenerateMapDataAsync();
+
+	//Same as GenerateMapData, but the stages are cut in small units of work and run from Tick within generationFrameBudget
+	//each frame, for platforms which cannot use worker threads. LandDoneDelegate is called once the map is spawned
+	UFUNCTION(BlueprintCallable)
+		bool GenerateMapDataTimeSliced();
+
+	//Whether an asynchronous or time sliced generation is running
 	UFUNCTION(BlueprintCallable)
-		void GenerateMapData();
+		bool IsGenerating() const;
 
 	UFUNCTION(BlueprintCallable)
 		int GetMeshCount();
 
+	//Same as GetMeshData, also returning the normals and tangents of the mesh
+	UFUNCTION(BlueprintCallable)
+		void GetMeshDataWithNormals(int meshIdx, TArray<FVector>& verts, TArray<int>& tris, TArray <FVector2D>& uvs,
+			TArray<FVector>& normals, TArray<FProcMeshTangent>& tangents, FLinearColor& color, int lod = 0);
+
+	//Amount of levels of detail of a mesh
+	UFUNCTION(BlueprintCallable)
+		int GetMeshLODCount(int meshIdx);
+
+	UFUNCTION(BlueprintCallable)
+		void GetMeshData(int meshIdx, TArray<FVector>& verts, TArray<int>& tris, TArray <FVector2D>& uvs, FLinearColor& color, int lod = 0);
+
+	//Indices of the meshes whose bounds are within radius of center
 	UFUNCTION(BlueprintCallable)
-		void GetMeshData(int meshIdx, TArray<FVector>& verts, TArray<int>& tris, TArray <FVector2D>& uvs, FLinearColor& color);
+		TArray<int> GetMeshesInRadius(FVector center, float radius);
+
+	UFUNCTION(BlueprintCallable)
+		int GetChunkMeshCount(FIntPoint chunk);
+
+	UFUNCTION(BlueprintCallable)
+		void GetChunkMeshData(FIntPoint chunk, int meshIdx, TArray<FVector>& verts, TArray<int>& tris, TArray <FVector2D>& uvs, FLinearColor& color, int lod = 0);
 
 	UFUNCTION(BlueprintCallable)
 		float GetWaterHeight();
@@ -183,26 +458,69 @@ protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
+	// Called when the actor is removed, waits for a running generation
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
 public:	
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
 
 private:
+	void UpdateChunks();
+	bool GenerateChunk(FIntPoint chunk);
+	void GenerateChunkData();
+	void FinishChunkGeneration(FIntPoint chunk);
+	void AddChunk(FIntPoint chunk, const TArray<ALand*>& lands);
+	void EvictChunk(FIntPoint chunk);
+	FString GetTileCacheKey(FIntPoint tile);
+	bool RestoreTileFromCache(FIntPoint tile, TArray<ALand*>& outLands);
+	void PrepareBuiltTile();
+	void StoreBuiltTile(FIntPoint tile);
+	bool CanStartGeneration(const TCHAR* request);
+	bool BeginMapGeneration();
+	void SnapshotParameters();
+	bool GenerateLandData();
+	void FinishMapGeneration(bool generated);
+	void ReportStage(EGenerationStage stage);
+	void UploadLands(const TArray<ALand*>& lands);
+	void UploadLand(ALand* land);
+	bool StepSlicedGeneration();
+	void AdvanceSlicedStage(EGenerationStage nextStage);
+	void ClearMap();
+	ALand* SpawnLand(FLandMeshData data);
+	ABiom* GetLevelBiom(int level);
+	int GetLevelBiomIndex(int level);
 	bool GenerateNoise();
+	void GenerateNoiseRows(PerlinNoiseGeneration& noiseGenerator, int firstRow, int lastRow, float& minNoise, float& maxNoise);
+	void NormalizeNoiseRows(int firstRow, int lastRow, float minNoise, float maxNoise);
 	void TerraceNoise();
+	void TerraceNoiseRows(int firstRow, int lastRow);
 	void ClusterNoise();
+	void FillLevelMask(int level);
 	void GenerateMesh();
-	ALand* GenerateTopMesh(TArray<FVector2D> points, int depth);
-	ALand* StoreEdge(ALand* mesh, TArray<FEdgeData> edges);
+	void BuildLands();
+	TArray<FIntPoint> GetLandJobs();
+	TArray<FLandMeshData> BuildLandData(int depth, int island, TArray<int32>& vertexGrid);
+	bool StepLandBuild(FLandBuild& build, TArray<int32>& vertexGrid);
+	TArray<FLandMeshData> SplitLandInBlocks(FLandMeshData&& land, const TArray<FIntPoint>& edgeBlocks);
+	void MergeLandsByBiom(TArray<FLandMeshData>& lands);
+	void AppendGeometry(FLandLOD& geometry, const FLandLOD& other);
+	FIntPoint GetLandBlock(const FVector& point);
+	void SplitGeometryInBlocks(const FLandLOD& geometry, TMap<FIntPoint, FLandLOD>& outBlocks);
+	FLandMeshData GenerateTopMesh(int depth, int island, TArray<int32>& vertexGrid, int stride = 1);
+	TArray<FIntPoint> GetTopMeshPoints(const FLandMeshData& mesh);
+	void RemoveChunkBorderEdges(const FLandMeshData& mesh, TArray<FMeshEdge>& edges);
+	void CullHiddenTop(FLandMeshData& mesh, int depth);
+	void MergeTopQuads(FLandMeshData& mesh, const TArray<FMeshEdge>& edges, TArray<int32>& vertexGrid);
+	void CompactVertices(FLandMeshData& mesh, TArray<FMeshEdge>& edges);
+	void StoreEdge(FLandMeshData& mesh, const TArray<FMeshEdge>& edges);
 	void Inflate(TArray<FVector2D>& points);
 	void Erode(TArray<FVector2D>& points);
 	void clampMap(TArray<FVector2D>& points);
-	TArray<FEdgeData> BuildEdge(int vertexCount, TArray<int> triangleArray);
-	TArray<FEdgeData> BuildManifoldEdge(ALand* mesh);
-	ALand* ExtrudeMesh(ALand* mesh, TArray<float> extrusion, TArray<FEdgeData> edges, bool invertFaces);
-	ALand* PerformMeshExtrusion(ALand* mesh, TArray<float> extrusionMatrix);
-	ALand* RemoveDuplicateVertices(ALand* mesh);
-	ALand* SmoothEdge(ALand* mesh, TArray<FEdgeData> edges);
+	void ExtrudeMesh(FLandMeshData& mesh, const TArray<float>& extrusion, const TArray<FMeshEdge>& edges, bool invertFaces, bool bottomCap = true);
+	void PerformMeshExtrusion(FLandMeshData& mesh, const TArray<float>& extrusionMatrix, const TArray<FMeshEdge>& edges);
+	void RemoveDuplicateVertices(FLandMeshData& mesh);
+	void SmoothEdge(FLandMeshData& mesh, const TArray<FMeshEdge>& edges);
 	void GenerateClouds();
 	TArray<TArray<FVector2D>> GetContours(TArray<FVector2D> points);
 	TArray<TArray<FVector2D>> IsolateOutterContours(TArray<TArray<FVector2D>> contours);
@@ -210,23 +528,69 @@ private:
 	int IsLeft(FVector2D P0, FVector2D P1, FVector2D P2);
 	bool IsInner(TArray<int> isInsideContour, int idx);
 	void PickLandmarks();
+	void SpawnLandmarks();
 	void MatchLandToLandmarks();
+	void BeginLandmarkFlattening();
+	void FlattenLandmark(const FLandmarkPlacement& landmark);
+	bool SpreadLandmarkFlattening();
+	void UpdateReshapedGradient();
 	void GenerateRockAndTrees();
+	void InitPropMeshes(AActor* prop, FIntPoint cell);
 	void InitBioms();
 	uint8* Smooth2DMap(uint8* Data);
 	uint8* Contour2DMap(uint8* Data);
 	uint8* ResampleMap(uint8* Data, int originalRes, int newRes);
 	
-	//2D noise map
-	float* noiseMap;
+	//parameters of the current (or last) generation
+	FMapGenerationParams params;
+
+	//buffers and pooled actors reused from one generation to the next
+	UPROPERTY()
+		FMapGenerationState generationState;
 
-	//array of clusters of points per level
-	TArray<TArray<TArray<FVector2D>>> clusters;
+	//background task of GenerateMapDataAsync or of a streamed chunk
+	TFuture<void> generationTask;
+
+	//set while an asynchronous generation (map or chunk) runs, until its actors are spawned
+	bool asyncGenerationRunning = false;
+
+	//progress of GenerateMapDataTimeSliced
+	FSlicedGeneration slicedGeneration;
+
+	//offset of the noise map in the noise space (in pixels, X along the columns and Y along the rows)
+	FIntPoint noiseOffset = FIntPoint(0, 0);
+
+	//offset applied to the map pixel coordinates to obtain the mesh coordinates
+	FVector2D meshOffset = FVector2D(0, 0);
+
+	//streamed chunks currently alive
+	UPROPERTY()
+		TMap<FIntPoint, FTerrainChunk> chunks;
+
+	//finished tiles
+	TileCache tileCache;
+
+	//copy of the map being generated for the tile cache, made before its lands are given to the actors
+	TSharedPtr<FCachedTile, ESPMode::ThreadSafe> builtTile;
+
+	//props spawned by the last GenerateRockAndTrees call
+	UPROPERTY()
+		TArray<AActor*> spawnedProps;
+
+	//amount of rows of the noise map generated by each parallel task
+	static const int noiseBandHeight = 16;
+
+	//minimum cosine between the normals of two close vertices for them to be welded
+	static constexpr float weldNormalThreshold = 0.99f;
 
 	//clouds
 	TArray<UStaticMesh*> cloudsDistribution;
 	TArray<FVector> cloudsPosition;
 
+	//cloud components spawned by the last SpawnClouds call
+	UPROPERTY()
+		TArray<UStaticMeshComponent*> cloudComponents;
+
 	//Bioms
 	TArray<ABiom*> inGameBioms;
 };
@@ -36,7 +36,8 @@ public:
 	UPROPERTY(EditAnywhere, Category = "Bioms")
 		TArray<float> spawnProbabilities;
 
-	TSubclassOf<AProp> GetRandomProp();
+	//Picks a ressource given a random number in [0, 1)
+	TSubclassOf<AProp> GetRandomProp(float proba);
 
 protected:
 	// Called when the game starts or when spawned
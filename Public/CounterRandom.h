@@ -0,0 +1,41 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Stages of the generation which draw random numbers. Each stage gets its own independent stream.
+ */
+enum class ERandomStage : uint32
+{
+	Noise,
+	Landmarks,
+	Clouds,
+	Props,
+	PropMeshes
+};
+
+/**
+ * Counter based random number generator (SplitMix style).
+ * Rather than advancing a hidden state, every number is a hash of the seed, the stage and a key (typically
+ * a cell coordinate and a counter). Draws can therefore happen in any order, from any thread, and only
+ * depend on the map seed.
+ */
+class TREASUREHUNT_API CounterRandom
+{
+public:
+	CounterRandom(int seed, ERandomStage stage);
+
+	//Random 32 bits integer for the given key
+	uint32 Hash(int x, int y = 0, int counter = 0) const;
+
+	//Random float in [0, 1) for the given key
+	float FRand(int x, int y = 0, int counter = 0) const;
+
+	//Random integer in [min, max] for the given key
+	int RandRange(int min, int max, int x, int y = 0, int counter = 0) const;
+
+private:
+	uint64 streamKey;
+};
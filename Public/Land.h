@@ -5,10 +5,94 @@
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
 #include "Public/Biom.h"
+#include "ProceduralMeshComponent.h"
+#include "Materials/MaterialInterface.h"
 
 
 #include "Land.generated.h"
 
+//Triangle mesh of a land at one level of detail
+struct FLandLOD
+{
+	TArray<FVector> verts;
+	TArray<int> tris;
+	TArray<FVector2D> uvs;
+
+	//per vertex normal and tangent (direction of increasing u)
+	TArray<FVector> normals;
+	TArray<FVector> tangents;
+
+	friend FArchive& operator<<(FArchive& Ar, FLandLOD& lod)
+	{
+		Ar << lod.verts;
+		Ar << lod.tris;
+		Ar << lod.uvs;
+		Ar << lod.normals;
+		Ar << lod.tangents;
+		return Ar;
+	}
+};
+
+//Plain geometry of a land. It can be generated, cached and handed over to an ALand
+struct FLandMeshData
+{
+	TArray<FVector> verts;
+	TArray<int> tris;
+	TArray<FVector2D> uvs;
+	TArray<FVector> normals;
+	TArray<FVector> tangents;
+	TArray<FVector> edges;
+
+	//terrace level of the land
+	int level = 0;
+
+	//block of the map the land covers when lands are split in blocks, (-1, -1) otherwise
+	FIntPoint block = FIntPoint(-1, -1);
+
+	//bounding box of the vertices
+	FBox bounds = FBox(ForceInit);
+
+	//lower levels of detail, lods[0] being LOD 1
+	TArray<FLandLOD> lods;
+
+	friend FArchive& operator<<(FArchive& Ar, FLandMeshData& data)
+	{
+		Ar << data.verts;
+		Ar << data.tris;
+		Ar << data.uvs;
+		Ar << data.normals;
+		Ar << data.tangents;
+		Ar << data.edges;
+		Ar << data.level;
+		Ar << data.block;
+		Ar << data.bounds;
+		Ar << data.lods;
+		return Ar;
+	}
+
+	//moves the full resolution mesh out of the land
+	FLandLOD TakeGeometry()
+	{
+		FLandLOD geometry;
+		geometry.verts = MoveTemp(verts);
+		geometry.tris = MoveTemp(tris);
+		geometry.uvs = MoveTemp(uvs);
+		geometry.normals = MoveTemp(normals);
+		geometry.tangents = MoveTemp(tangents);
+		return geometry;
+	}
+
+	//moves a mesh in the land as its full resolution mesh
+	void SetGeometry(FLandLOD&& geometry)
+	{
+		verts = MoveTemp(geometry.verts);
+		tris = MoveTemp(geometry.tris);
+		uvs = MoveTemp(geometry.uvs);
+		normals = MoveTemp(geometry.normals);
+		tangents = MoveTemp(geometry.tangents);
+	}
+};
+
 UCLASS()
 class TREASUREHUNT_API ALand : public AActor
 {
@@ -33,6 +117,14 @@ public:
 	UPROPERTY(BlueprintReadOnly)
 		TArray<FVector2D> uvs;
 
+	//normals of the land mesh
+	UPROPERTY(BlueprintReadOnly)
+		TArray<FVector> normals;
+
+	//tangents of the land mesh (direction of increasing u)
+	UPROPERTY(BlueprintReadOnly)
+		TArray<FVector> tangents;
+
 	//position of the end verts of each edge
 	UPROPERTY()
 		TArray<FVector> edges;
@@ -41,6 +133,43 @@ public:
 	UPROPERTY(BlueprintReadOnly)
 		ABiom* biom;
 
+	//terrace level of the land
+	UPROPERTY(BlueprintReadOnly)
+		int level = 0;
+
+	//block of the map the land covers when lands are split in blocks, (-1, -1) otherwise
+	UPROPERTY(BlueprintReadOnly)
+		FIntPoint block = FIntPoint(-1, -1);
+
+	//bounding box of the vertices of the land
+	UPROPERTY(BlueprintReadOnly)
+		FBox bounds = FBox(ForceInit);
+
+	//lower levels of detail, lods[0] being LOD 1
+	TArray<FLandLOD> lods;
+
+	//mesh built by UploadMesh, null until then
+	UPROPERTY(BlueprintReadOnly)
+		UProceduralMeshComponent* meshComponent = nullptr;
+
+	//copy of the geometry of the land
+	FLandMeshData GetMeshData() const;
+
+	//copy of the geometry of a level of detail, 0 being the full resolution. Clamped to the lowest detail available
+	void GetLODData(int lod, TArray<FVector>& outVerts, TArray<int>& outTris, TArray<FVector2D>& outUVs) const;
+
+	//same as GetLODData, with the normals and tangents of the level of detail
+	void GetLODData(int lod, TArray<FVector>& outVerts, TArray<int>& outTris, TArray<FVector2D>& outUVs,
+		TArray<FVector>& outNormals, TArray<FProcMeshTangent>& outTangents) const;
+
+	//replace the geometry of the land
+	void SetMeshData(const FLandMeshData& data);
+	void SetMeshData(FLandMeshData&& data);
+
+	//Fills the mesh component of the land (created on first use) with its full resolution geometry, coloured with its biom,
+	//with collision so that props can find it. If releaseData is set, the geometry kept on the land is freed afterwards
+	void UploadMesh(UMaterialInterface* material, bool releaseData);
+
 	//Given a position and a radius, check wether an object can be spawned on the mesh
 	UFUNCTION(BlueprintCallable)
 		bool checkObjectFits(FVector position, float radius);
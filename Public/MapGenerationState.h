@@ -0,0 +1,151 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Land.h"
+#include "Landmark.h"
+
+#include "MapGenerationState.generated.h"
+
+//Connected area of pixels (4 connectivity) which are all at a given level or higher
+struct FTerrainIsland
+{
+	int level = 0;
+
+	//island of the level below which contains this one, -1 on the lowest level
+	int parent = -1;
+
+	//smallest pixel index of the island
+	int firstPixel = 0;
+
+	int pixelCount = 0;
+
+	//bounding box of the island in pixels (max excluded)
+	FIntRect bounds;
+};
+
+//Where a landmark goes on the map. Picked from the class defaults so that it can be computed away from the game thread
+struct FLandmarkPlacement
+{
+	TSubclassOf<ALandmark> landmarkClass;
+
+	//position on the map in pixels (X along the rows and Y along the columns)
+	FVector2D mapPosition;
+
+	int radius = 0;
+	float baseHeight = 0;
+};
+
+/**
+ * Everything a map generation allocates, kept from one generation to the next. Buffers keep their memory
+ * when they are resized for a new map, and lands and landmarks are parked in pools rather than destroyed,
+ * so regenerating a map of the same size barely allocates anything.
+ */
+USTRUCT()
+struct TREASUREHUNT_API FMapGenerationState
+{
+	GENERATED_BODY()
+
+	//2D noise map. Only meaningful until the noise is terraced
+	TArray<float> noiseMap;
+
+	//analytic gradient of the noise map before terracing (X along the columns and Y along the rows). Empty unless it is requested
+	TArray<FVector2D> noiseGradient;
+
+	//terrace level of each pixel, produced once by the terrace stage and read by every later stage
+	TArray<uint8> levelMap;
+
+	//for each level, one bit per pixel telling whether the pixel is at that level or higher
+	TArray<TBitArray<>> levelMasks;
+
+	//pixels already flattened by the landmarks, one bit per pixel
+	TBitArray<> landmarkMask;
+
+	//outer ring of the pixels flattened by the landmarks, spread one ring at a time
+	TArray<FVector2D> landmarkFrontier;
+
+	//pixels whose height was changed by the spread of the landmark flattening, their gradient is updated once it is done
+	TArray<int32> landmarkReshaped;
+
+	//vertex index of each pixel in the mesh being built, INDEX_NONE for pixels which are not in it.
+	//There is one grid per worker building meshes in parallel
+	TArray<TArray<int32>> vertexGrids;
+
+	//islands of every level
+	TArray<FTerrainIsland> islands;
+
+	//indices in islands of the islands of each level
+	TArray<TArray<int>> levelIslands;
+
+	//for each pixel, index of the island it belongs to at its own level
+	TArray<int> islandMap;
+
+	//landmarks picked for the map, spawned once the lands are
+	TArray<FLandmarkPlacement> landmarkPlacements;
+
+	//geometry of the lands built by the mesh stage, waiting to be given to actors on the game thread
+	TArray<FLandMeshData> builtLands;
+
+	//side of the map the buffers are sized for
+	int mapSize = 0;
+
+	//Sizes the buffers for a map of mapSize * mapSize pixels, reusing their memory
+	void Reset(int mapSize, bool withGradient);
+
+	//Clears the level masks, reusing their memory
+	void ResetLevelMasks(int levelCount);
+
+	//Makes sure there are at least count empty vertex grids of the size of the map
+	void ResetVertexGrids(int count);
+
+	//Splits the mask of each level in islands. The levels are labeled one after the other, each of them by
+	//bands of rows in parallel (union find) which are then stitched together, so it runs in linear time
+	void LabelIslands(int bandHeight, bool singleThreaded);
+
+	//Same as LabelIslands, a level at a time: BeginLabelIslands then LabelLevelIslands for each level in order,
+	//as the islands of a level are parented to the ones of the level below
+	void BeginLabelIslands();
+	void LabelLevelIslands(int level, int bandHeight, bool singleThreaded);
+
+	//Island of the given level containing a pixel, -1 if the pixel is below that level
+	int GetIslandAtLevel(int pixel, int level) const;
+
+	//Whether the pixel (x, y) belongs to the mask of a level. Pixels outside of the map never do
+	bool IsInLevel(int level, int x, int y) const
+	{
+		return x >= 0 && y >= 0 && x < mapSize && y < mapSize && levelMasks[level][y * mapSize + x];
+	}
+
+	//Iterates over the indices (y * mapSize + x) of the pixels of a level, in row order
+	TConstSetBitIterator<> LevelPixels(int level) const
+	{
+		return TConstSetBitIterator<>(levelMasks[level]);
+	}
+
+	//Returns an empty land from the pool, or spawns a new one if the pool is empty
+	ALand* AcquireLand(UWorld* world);
+
+	//Clears a land and puts it back in the pool
+	void ReleaseLand(ALand* land);
+
+	//Returns a landmark of the given class from the pool, or spawns a new one if there is none
+	ALandmark* AcquireLandmark(UWorld* world, UClass* landmarkClass);
+
+	//Hides a landmark and puts it back in the pool
+	void ReleaseLandmark(ALandmark* landmark);
+
+private:
+	//union find parents while labeling, then root of each pixel
+	TArray<int32> islandLabels;
+
+	//island of each pixel at the level being labeled and at the level below
+	TArray<int32> islandIds;
+	TArray<int32> previousIslandIds;
+
+	UPROPERTY()
+		TArray<ALand*> landPool;
+
+	UPROPERTY()
+		TArray<ALandmark*> landmarkPool;
+};
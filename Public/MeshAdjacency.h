@@ -0,0 +1,34 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+//Edge of a triangle mesh, going from v0 to v1 in the winding order of face0. face1 is INDEX_NONE for boundary edges
+struct FMeshEdge
+{
+	int32 v0 = INDEX_NONE;
+	int32 v1 = INDEX_NONE;
+	int32 face0 = INDEX_NONE;
+	int32 face1 = INDEX_NONE;
+
+	bool IsBoundary() const { return face1 == INDEX_NONE; }
+};
+
+/**
+ * Edge adjacency of a triangle mesh, built in a single hashed pass over the triangles.
+ * Gives the edges with the faces on each side and the boundary edges.
+ */
+class TREASUREHUNT_API MeshAdjacency
+{
+public:
+	MeshAdjacency(const TArray<int>& tris);
+
+	const TArray<FMeshEdge>& GetEdges() const { return edges; }
+
+	//Edges used by a single triangle, oriented like that triangle
+	TArray<FMeshEdge> GetBoundaryEdges() const;
+
+private:
+	TArray<FMeshEdge> edges;
+};
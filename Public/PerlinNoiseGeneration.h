@@ -3,24 +3,54 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "CounterRandom.h"
 
 /**
- * 
+ *
  */
 class TREASUREHUNT_API PerlinNoiseGeneration
 {
 public:
-	PerlinNoiseGeneration(int seed, int mapSize, int octaves, float persistance, float baseFreq);
+	PerlinNoiseGeneration(int seed, int mapSize, int octaves, float persistance, float baseFreq, bool legacyGradients = false);
 	~PerlinNoiseGeneration();
+	PerlinNoiseGeneration(const PerlinNoiseGeneration&) = delete;
+	PerlinNoiseGeneration& operator=(const PerlinNoiseGeneration&) = delete;
 	float Perlin(float x, float y);
+	float Perlin(float x, float y, float& dx, float& dy);
 	float PerlinNoiseValue(float x, float y);
-	
+
+	//Same as PerlinNoiseValue, also returning the analytic derivative of the noise along x and y
+	float PerlinNoiseValue(float x, float y, float& dx, float& dy);
+
+	//Fills count samples of PerlinNoiseValue along a row, from (x, y) to (x, y + count - 1).
+	//When vectorized, 4 samples are evaluated at once with the engine vector intrinsics. The vectorized
+	//results match the scalar ones within 1e-5 (only the order of the float operations differs).
+	//If outDx and outDy are given, the derivatives are filled in the same pass (vectorized as well when requested).
+	void PerlinNoiseRow(float x, float y, int count, float* outValues, bool vectorized = true, float* outDx = nullptr, float* outDy = nullptr);
+
 
 private:
 	float Fade(float t);
+	float FadeDerivative(float t);
 	float Lerp(float a, float b, float t);
 	float DotGridGradient(int ix, int iy, float x, float y);
-	float* gradient;
+	int HashGradientIndex(int ix, int iy);
+	void GradientAt(int ix, int iy, float& gx, float& gy);
+	void PerlinRowVectorized(float x, float y, float frequency, float amplitude, int count, float* outValues, float* outDx, float* outDy);
+
+	//amount of gradient directions the hashed lattice picks from
+	static const int gradientDirectionCount = 256;
+
+	//legacy per pixel gradient table. Only allocated when legacy gradients are requested
+	float* gradient = nullptr;
+
+	//unit gradient directions used by the hashed lattice
+	float gradientDirections[2 * gradientDirectionCount];
+
+	//picks the gradient direction of each lattice point
+	CounterRandom latticeRandom;
+
+	bool legacyGradients;
 	int mapSize;
 	int octaves;
 	float persistance;
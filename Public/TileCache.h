@@ -0,0 +1,68 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+#include "Land.h"
+
+//Finished result of the generation of a tile (the whole map or a streamed chunk)
+struct FCachedTile
+{
+	//terrace level of each pixel
+	TArray<uint8> levelMap;
+
+	//gradient of the noise map, empty if it was not computed
+	TArray<FVector2D> noiseGradient;
+
+	//geometry of every land of the tile
+	TArray<FLandMeshData> lands;
+};
+
+//Tiles are shared between the cache and the tasks writing them to disk, so they are never modified once cached
+typedef TSharedRef<FCachedTile, ESPMode::ThreadSafe> FCachedTileRef;
+
+/**
+ * Cache of generated tiles, keyed by a string describing every parameter the generation depends on.
+ * Recently used tiles are kept in memory (least recently used ones are dropped first), and all tiles
+ * can optionally be written to disk so that they survive across sessions. Disk writes run in the background
+ * when the platform has worker threads, a file is only read once its pending write is done.
+ */
+class TREASUREHUNT_API TileCache
+{
+public:
+	TileCache();
+
+	//Waits for the pending disk writes
+	~TileCache();
+
+	//Set the amount of tiles kept in memory and whether tiles are also stored on disk
+	void Configure(int capacity, bool useDisk);
+
+	//Retrieves a tile from memory, or from disk if it is not in memory anymore
+	bool Find(const FString& key, FCachedTile& outTile);
+
+	void Add(const FString& key, const FCachedTile& tile);
+
+	//Adds a finished tile without copying it
+	void Add(const FString& key, FCachedTileRef tile);
+
+private:
+	FString GetFilePath(const FString& key) const;
+	bool LoadFromDisk(const FString& key, FCachedTile& outTile) const;
+	static void SaveToDisk(const FString& path, const FString& key, FCachedTile tile);
+	void WaitForWrite(const FString& path);
+	void Touch(const FString& key);
+	void Trim();
+
+	TMap<FString, TSharedPtr<FCachedTile, ESPMode::ThreadSafe>> tiles;
+
+	//keys from least to most recently used
+	TArray<FString> usageOrder;
+
+	//disk writes still running, by file path
+	TMap<FString, TFuture<void>> pendingWrites;
+
+	int capacity;
+	bool useDisk;
+};
@@ -18,6 +18,17 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite)
 		TArray<UStaticMesh*> MeshCandidates;
 
+	//Seed used to pick among the mesh candidates
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		int seed = 0;
+
+	//Map cell (in world map coordinates) the pick is keyed on
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		FIntPoint cell = FIntPoint(0, 0);
+
+	//Sets the seed and cell of the generator and picks the mesh again
+	void InitMesh(int newSeed, FIntPoint newCell);
+
 	//Mesh
 	UPROPERTY(EditAnywhere, Category = "Properties")
 		UStaticMeshComponent* TreeMesh;
@@ -26,6 +37,9 @@ protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
+	//Picks the mesh among the candidates from the seed and the cell
+	void PickMesh();
+
 public:	
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;